@@ -1,94 +1,1074 @@
 
 #include <msp430f5438a.h>
+#include <stddef.h>
+#include <string.h>
+#include "HAL.h"
 #include "I2C.h"
 
-unsigned char* g_pI2CData;
-unsigned char g_I2CCount;
+// Every USCI_B module is a bus of its own with its own queue of transfers,
+// the registers are accessed relative to the base address of the module.
+// The DMA controller can only be triggered by UCB0 and UCB1. On the first of
+// them which is used the data is moved by DMA and the ISR only handles the
+// start and the end of a transfer and NACKs, on the other buses the ISR
+// moves every byte. The Debug_DMA build configuration adds bus 0
+// (I2C_BUSES=0x09), so the DMA path is built as well.
+#if I2C_BUSES & BIT0
+#define I2C_DMA_BUS			0
+#define I2C_DMA_RX_TRIGGER	18
+#define I2C_DMA_TX_TRIGGER	19
+#elif I2C_BUSES & BIT1
+#define I2C_DMA_BUS			1
+#define I2C_DMA_RX_TRIGGER	22
+#define I2C_DMA_TX_TRIGGER	23
+#endif
 
-int g_I2CError;
+#ifdef I2C_DMA_BUS
+#define I2C_DMA
+#endif
 
+// registers of the USCI_B module of a bus
+#define I2C_REG8(bus, offset)	(*((volatile unsigned char *)((bus)->base + (offset))))
+#define I2C_REG16(bus, offset)	(*((volatile unsigned int *)((bus)->base + (offset))))
+
+#define I2C_CTL1(bus)		I2C_REG8(bus, 0x00)
+#define I2C_CTL0(bus)		I2C_REG8(bus, 0x01)
+#define I2C_BRW(bus)		I2C_REG16(bus, 0x06)
+#define I2C_STAT(bus)		I2C_REG8(bus, 0x0A)
+#define I2C_RXBUF(bus)		I2C_REG8(bus, 0x0C)
+#define I2C_TXBUF(bus)		I2C_REG8(bus, 0x0E)
+#define I2C_SA(bus)			I2C_REG16(bus, 0x12)
+#define I2C_IE(bus)			I2C_REG8(bus, 0x1C)
+#define I2C_IFG(bus)		I2C_REG8(bus, 0x1D)
+#define I2C_IV(bus)			I2C_REG16(bus, 0x1E)
+
+#ifdef I2C_DMA
+// DMA channel 1 moves the TX data and channel 2 the RX data, channel 0 is
+// left to the HAL. Short transfers are not worth setting up the DMA.
+#define I2C_DMA_MIN			4
+#endif
+
+// Every transaction is guarded by a timeout on TB0, which runs from ACLK
+// (set up in main). CCR1-CCR4 belong to the buses 0-3. If a device holds
+// SDA low or stretches SCL forever, the transfer is aborted with I2C_TIMEOUT
+// and the bus is recovered by clocking SCL up to 9 times and sending a stop
+// condition by hand. The timeout allows for the length of the transfer at
+// 100 kHz.
+#define I2C_TIMEOUT_BASE		328		// ACLK ticks, 10 ms
+#define I2C_TIMEOUT_PER_BYTE	4		// ACLK ticks, 122 us
+#define I2C_TIMEOUT_MAX			32768	// ACLK ticks, 1 s
+
+// busy waits for the USCI are bounded as well
+#define I2C_SPIN_TIMEOUT		33		// ACLK ticks, 1 ms
+
+// half of a SCL period of the recovery sequence, 5 us at 25 MHz
+#define I2C_RECOVERY_DELAY		125
+
+#define I2C_TIMER_CTL(bus)		((&TB0CCTL1)[bus])
+#define I2C_TIMER_CCR(bus)		((&TB0CCR1)[bus])
+
+// port registers relative to PxIN
+#define I2C_PORT(port, offset)	(*((volatile unsigned char *)((port) + (offset))))
+#define I2C_PORT_IN		0x00
+#define I2C_PORT_OUT	0x02
+#define I2C_PORT_DIR	0x04
+#define I2C_PORT_SEL	0x0A
+
+typedef struct
+{
+	unsigned int base;
+
+	// the pins of the bus, needed for the recovery
+	unsigned int sda_port;
+	unsigned char sda_pin;
+	unsigned int scl_port;
+	unsigned char scl_pin;
+
+	// state of the current phase
+	unsigned char* data;
+	unsigned int count;
+	unsigned char reading;
+
+	// set while a partial transfer holds the bus
+	unsigned char held;
+
+	unsigned int prescaler;
+
+	// queue of the submitted transfers, the first one is on the bus
+	I2C_transfer_t* queue;
+	I2C_transfer_t* tail;
+} I2C_bus_t;
+
+I2C_bus_t g_I2CBus[I2C_BUS_COUNT];
+
+// finished transfers whose callbacks have not been run yet
+I2C_transfer_t* g_pI2CDone = NULL;
+I2C_transfer_t* g_pI2CDoneTail = NULL;
+
+// The prescaler is switched at the start of every transaction to the speed
+// of the addressed device. The table only holds the devices which do not run
+// at the default 100 kHz.
+#ifndef I2C_SPEED_TABLE_SIZE
+#define I2C_SPEED_TABLE_SIZE	8
+#endif
+
+const unsigned long g_I2CSpeedHz[I2C_SPEEDS] = { 100000, 400000, 1000000 };
+
+unsigned int g_I2CPrescaler[I2C_SPEEDS];
+
+unsigned char g_I2CSpeedBus[I2C_SPEED_TABLE_SIZE];
+unsigned char g_I2CSpeedAddr[I2C_SPEED_TABLE_SIZE];
+unsigned char g_I2CSpeed[I2C_SPEED_TABLE_SIZE];
+unsigned char g_I2CSpeedCount = 0;
+
+// Register reads (one byte register address, up to I2C_CACHE_DATA bytes
+// of data) of the devices in the TTL table are cached. A read which hits
+// a valid entry is finished by I2C_submit() without touching the bus, a
+// write to the device drops the entries of the registers it changes. The
+// cache has its own time base: the overflows of TB0 extend it to 32 bit.
+#ifndef I2C_CACHE_TABLE_SIZE
+#define I2C_CACHE_TABLE_SIZE	8
+#endif
+#ifndef I2C_CACHE_ENTRIES
+#define I2C_CACHE_ENTRIES		8
+#endif
+#ifndef I2C_CACHE_DATA
+#define I2C_CACHE_DATA			8
+#endif
+
+typedef struct
+{
+	unsigned char valid;
+	unsigned char bus;
+	unsigned char addr;
+	unsigned char reg;
+	unsigned char len;
+	unsigned long expires;
+	unsigned char data[I2C_CACHE_DATA];
+} I2C_cache_entry_t;
+
+I2C_cache_entry_t g_I2CCache[I2C_CACHE_ENTRIES];
+
+unsigned char g_I2CCacheBus[I2C_CACHE_TABLE_SIZE];
+unsigned char g_I2CCacheAddr[I2C_CACHE_TABLE_SIZE];
+unsigned long g_I2CCacheTTL[I2C_CACHE_TABLE_SIZE];		// ACLK ticks
+unsigned char g_I2CCacheCount = 0;
+
+unsigned long g_I2CCacheHits = 0;
+unsigned long g_I2CCacheMisses = 0;
+
+volatile unsigned int g_I2CTimeHigh = 0;
+
+
+int I2C_bus_enabled(unsigned char bus)
+{
+	return bus < I2C_BUS_COUNT && (I2C_BUSES & (1 << bus));
+}
+
+// (re)initializes the USCI of a bus
+static void I2C_reset(I2C_bus_t* bus)
+{
+	I2C_CTL1(bus) |= UCSWRST;                      // Enable SW reset
+	I2C_CTL0(bus) = UCMST + UCMODE_3 + UCSYNC;     // I2C Master, synchronous mode
+	I2C_CTL1(bus) = UCSSEL_2 + UCSWRST;            // Use SMCLK, keep SW reset
+	I2C_BRW(bus) = bus->prescaler;                 // fSCL = SMCLK/prescaler
+	I2C_CTL1(bus) &= ~UCSWRST;                     // Clear SW reset, resume operation
+	I2C_IE(bus) |= UCTXIE + UCNACKIE + UCRXIE;     // Enable TX interrupt, enable NACK interrupt; Enable RX interrupt
+}
+
+// TB0 runs asynchronous to MCLK, so the counter is read until two
+// consecutive reads match
+static unsigned int I2C_time()
+{
+	unsigned int time;
+
+	do
+	{
+		time = TB0R;
+	} while(time != TB0R);
+
+	return time;
+}
+
+// 32 bit ACLK time of the cache
+static unsigned long I2C_clock()
+{
+	unsigned int high;
+	unsigned int low;
+	unsigned short state = __get_interrupt_state();
+
+	__disable_interrupt();
+
+	high = g_I2CTimeHigh;
+	low = I2C_time();
+
+	// the overflow has not been counted by the ISR yet
+	if((TB0CTL & TBIFG) && low < 0x8000)
+		high++;
+
+	__set_interrupt_state(state);
+
+	return ((unsigned long)high << 16) | low;
+}
+
+// waits until the USCI has cleared the bits in CTL1 (start or stop condition
+// sent), returns 0 if this did not happen in time
+static int I2C_spin(I2C_bus_t* bus, unsigned char bits)
+{
+	unsigned int start = I2C_time();
+
+	while(I2C_CTL1(bus) & bits)
+	{
+		if(I2C_time() - start > I2C_SPIN_TIMEOUT)
+			return 0;
+	}
+
+	return 1;
+}
 
 void I2C_init()
 {
-	P10SEL = BIT1 + BIT2;                     // Assign I2C pins to USCI_B0
-	UCB3CTL1 |= UCSWRST;                      // Enable SW reset
-	UCB3CTL0 = UCMST + UCMODE_3 + UCSYNC;     // I2C Master, synchronous mode
-	UCB3CTL1 = UCSSEL_2 + UCSWRST;            // Use SMCLK, keep SW reset
-	UCB3BR0 = 160;                            // fSCL = SMCLK/160 = ~100kHz
-	UCB3BR1 = 0;
-	UCB3CTL1 &= ~UCSWRST;                     // Clear SW reset, resume operation
-	UCB3IE |= UCTXIE + UCNACKIE + UCRXIE;     // Enable TX interrupt, enable NACK interrupt; Enable RX interrupt
+	int i;
+
+	// Assign I2C pins to the USCI_B modules
+#if I2C_BUSES & BIT0
+	P3SEL |= BIT1 + BIT2;
+#endif
+#if I2C_BUSES & BIT1
+	P3SEL |= BIT7;
+	P5SEL |= BIT4;
+#endif
+#if I2C_BUSES & BIT2
+	P9SEL |= BIT1 + BIT2;
+#endif
+#if I2C_BUSES & BIT3
+	P10SEL |= BIT1 + BIT2;
+#endif
+
+	g_I2CBus[0].base = (unsigned int)&UCB0CTLW0;
+	g_I2CBus[1].base = (unsigned int)&UCB1CTLW0;
+	g_I2CBus[2].base = (unsigned int)&UCB2CTLW0;
+	g_I2CBus[3].base = (unsigned int)&UCB3CTLW0;
+
+	g_I2CBus[0].sda_port = (unsigned int)&P3IN;
+	g_I2CBus[0].sda_pin = BIT1;
+	g_I2CBus[0].scl_port = (unsigned int)&P3IN;
+	g_I2CBus[0].scl_pin = BIT2;
+	g_I2CBus[1].sda_port = (unsigned int)&P3IN;
+	g_I2CBus[1].sda_pin = BIT7;
+	g_I2CBus[1].scl_port = (unsigned int)&P5IN;
+	g_I2CBus[1].scl_pin = BIT4;
+	g_I2CBus[2].sda_port = (unsigned int)&P9IN;
+	g_I2CBus[2].sda_pin = BIT1;
+	g_I2CBus[2].scl_port = (unsigned int)&P9IN;
+	g_I2CBus[2].scl_pin = BIT2;
+	g_I2CBus[3].sda_port = (unsigned int)&P10IN;
+	g_I2CBus[3].sda_pin = BIT1;
+	g_I2CBus[3].scl_port = (unsigned int)&P10IN;
+	g_I2CBus[3].scl_pin = BIT2;
+
+	// the prescalers are rounded up so the devices are never clocked too fast
+	for(i = 0; i < I2C_SPEEDS; i++)
+		g_I2CPrescaler[i] = (HAL_GetSystemSpeed() + g_I2CSpeedHz[i] - 1) / g_I2CSpeedHz[i];
+
+	for(i = 0; i < I2C_BUS_COUNT; i++)
+	{
+		I2C_bus_t* bus = &g_I2CBus[i];
+
+		if(!I2C_bus_enabled(i))
+			continue;
+
+		bus->prescaler = g_I2CPrescaler[I2C_SPEED_100K];
+		I2C_reset(bus);
+	}
+
+	// count the overflows of TB0 for I2C_clock()
+	TB0CTL |= TBIE;
+
+#ifdef I2C_DMA
+	// select the triggers of the channels 1 and 2, no DMA transfers during
+	// read-modify-write instructions
+	DMACTL0 = (DMACTL0 & 0x00FF) | (I2C_DMA_TX_TRIGGER << 8);
+	DMACTL1 = (DMACTL1 & 0xFF00) | I2C_DMA_RX_TRIGGER;
+	DMACTL4 = DMARMWDIS;
+
+	DMA1DAL = (unsigned int)&I2C_TXBUF(&g_I2CBus[I2C_DMA_BUS]);
+	DMA2SAL = (unsigned int)&I2C_RXBUF(&g_I2CBus[I2C_DMA_BUS]);
+#endif
 }
 
-int I2C_write(unsigned char addr, unsigned char* TxData, unsigned char len)
+#ifdef I2C_DMA
+// moves the remaining bytes of the TX phase by DMA, the first byte is written
+// directly if TXIFG is already pending as the DMA is only triggered by an edge
+// returns 0 if the phase is too short for DMA
+static int I2C_dma_tx(I2C_bus_t* bus)
 {
-	if(len == 0)
+	if(bus != &g_I2CBus[I2C_DMA_BUS] || bus->count < I2C_DMA_MIN)
 		return 0;
 
-	// load data into globals
-	g_I2CCount = len;
-	g_pI2CData = TxData;
-	g_I2CError = 0;
+	// the ISR must not be called for the bytes moved by DMA
+	I2C_IE(bus) &= ~UCTXIE;
+
+	if(I2C_IFG(bus) & UCTXIFG)
+	{
+		I2C_TXBUF(bus) = *bus->data++;
+		bus->count--;
+	}
 
-	// set slave address
-	UCB3I2CSA = addr;
+	DMA1SAL = (unsigned int)bus->data;
+	DMA1SZ = bus->count;
+	DMA1CTL = DMADT_0 + DMASRCINCR_3 + DMASBDB + DMAIE + DMAEN;
 
-	UCB3CTL1 |= UCTR + UCTXSTT;             // I2C TX, start condition
+	bus->data += bus->count;
+	bus->count = 0;
+	return 1;
+}
 
-	__bis_SR_register(LPM0_bits + GIE);     // Enter LPM0, enable interrupts
-	__no_operation();                       // Remain in LPM0 until all data
-											// is TX'd
+// moves the bytes of the RX phase by DMA, the last byte of a transaction is
+// left to the ISR because the stop condition has to be requested before it
+// is received. A byte waiting in RXBUF is read directly.
+// returns 0 if the phase is too short for DMA
+static int I2C_dma_rx(I2C_bus_t* bus, unsigned char last)
+{
+	unsigned int count = bus->count;
 
-	return g_I2CError;
+	if(bus != &g_I2CBus[I2C_DMA_BUS])
+		return 0;
+
+	if(last)
+		count--;
+
+	if(count < I2C_DMA_MIN)
+		return 0;
+
+	I2C_IE(bus) &= ~UCRXIE;
+
+	if(I2C_IFG(bus) & UCRXIFG)
+	{
+		*bus->data++ = I2C_RXBUF(bus);
+		bus->count--;
+		count--;
+	}
+
+	DMA2DAL = (unsigned int)bus->data;
+	DMA2SZ = count;
+	DMA2CTL = DMADT_0 + DMADSTINCR_3 + DMASBDB + DMAIE + DMAEN;
+
+	bus->data += count;
+	bus->count -= count;
+	return 1;
 }
 
-int I2C_read(unsigned char addr, unsigned char* RxData, unsigned char len)
+static void I2C_dma_stop(I2C_bus_t* bus)
 {
-	// check for invalid parameters
-	if(len == 0)
+	if(bus != &g_I2CBus[I2C_DMA_BUS])
+		return;
+
+	DMA1CTL = 0;
+	DMA2CTL = 0;
+}
+#endif
+
+// sets the speed of a device, returns 1 if the table is full
+int I2C_set_speed(unsigned char bus, unsigned char addr, unsigned char speed)
+{
+	int i;
+	int ret = 0;
+	unsigned short state = __get_interrupt_state();
+
+	if(speed >= I2C_SPEEDS || !I2C_bus_enabled(bus))
+		return 1;
+
+	// the table is also read by the ISR
+	__disable_interrupt();
+
+	for(i = 0; i < g_I2CSpeedCount; i++)
+	{
+		if(g_I2CSpeedBus[i] == bus && g_I2CSpeedAddr[i] == addr)
+			break;
+	}
+
+	if(speed == I2C_SPEED_100K)
+	{
+		// default speed, the entry is not needed anymore
+		if(i < g_I2CSpeedCount)
+		{
+			g_I2CSpeedCount--;
+			g_I2CSpeedBus[i] = g_I2CSpeedBus[g_I2CSpeedCount];
+			g_I2CSpeedAddr[i] = g_I2CSpeedAddr[g_I2CSpeedCount];
+			g_I2CSpeed[i] = g_I2CSpeed[g_I2CSpeedCount];
+		}
+	}
+	else if(i < g_I2CSpeedCount)
+		g_I2CSpeed[i] = speed;
+	else if(g_I2CSpeedCount < I2C_SPEED_TABLE_SIZE)
+	{
+		g_I2CSpeedBus[i] = bus;
+		g_I2CSpeedAddr[i] = addr;
+		g_I2CSpeed[i] = speed;
+		g_I2CSpeedCount++;
+	}
+	else
+		ret = 1;
+
+	__set_interrupt_state(state);
+	return ret;
+}
+
+// switches the prescaler to the speed of the device, the bus has to be idle
+static void I2C_select_speed(I2C_bus_t* bus, unsigned char busnum, unsigned char addr)
+{
+	unsigned int prescaler = g_I2CPrescaler[I2C_SPEED_100K];
+	int i;
+
+	for(i = 0; i < g_I2CSpeedCount; i++)
+	{
+		if(g_I2CSpeedBus[i] == busnum && g_I2CSpeedAddr[i] == addr)
+		{
+			prescaler = g_I2CPrescaler[g_I2CSpeed[i]];
+			break;
+		}
+	}
+
+	if(prescaler == bus->prescaler)
+		return;
+
+	// the stop condition of the last transaction must not be cut off
+	I2C_spin(bus, UCTXSTP);
+
+	// the prescaler can only be changed in reset, which clears the interrupt
+	// enables as well
+	bus->prescaler = prescaler;
+	I2C_reset(bus);
+}
+
+// drops the cached registers reg to reg+count-1 of a device
+static void I2C_cache_invalidate(unsigned char bus, unsigned char addr, unsigned int reg, unsigned int count)
+{
+	int i;
+
+	for(i = 0; i < I2C_CACHE_ENTRIES; i++)
+	{
+		I2C_cache_entry_t* e = &g_I2CCache[i];
+
+		if(e->bus == bus && e->addr == addr && e->reg < reg + count && reg < e->reg + e->len)
+			e->valid = 0;
+	}
+}
+
+// drops the cached registers a write changes. A write which starts a
+// transfer begins with the register address, a single byte only sets the
+// register pointer. The registers of a write which continues a transfer
+// are not known, all of the device are dropped then.
+static void I2C_cache_written(I2C_transfer_t* transfer)
+{
+	if(!(transfer->flags & I2C_FIRST))
+	{
+		if(transfer->txlen)
+			I2C_cache_invalidate(transfer->bus, transfer->addr, 0, 256);
+	}
+	else if(transfer->txlen > 1)
+		I2C_cache_invalidate(transfer->bus, transfer->addr, transfer->txdata[0], transfer->txlen - 1);
+}
+
+// sets the time a register read of the device stays valid in the cache,
+// 0 disables caching for the device. Returns 1 if the table is full.
+int I2C_set_cache(unsigned char bus, unsigned char addr, unsigned int ttl)
+{
+	int i;
+	int ret = 0;
+	unsigned short state = __get_interrupt_state();
+
+	if(!I2C_bus_enabled(bus))
+		return 1;
+
+	// the cache is also updated by the ISR
+	__disable_interrupt();
+
+	for(i = 0; i < g_I2CCacheCount; i++)
+	{
+		if(g_I2CCacheBus[i] == bus && g_I2CCacheAddr[i] == addr)
+			break;
+	}
+
+	if(ttl == 0)
+	{
+		// caching disabled, the entry is not needed anymore
+		if(i < g_I2CCacheCount)
+		{
+			g_I2CCacheCount--;
+			g_I2CCacheBus[i] = g_I2CCacheBus[g_I2CCacheCount];
+			g_I2CCacheAddr[i] = g_I2CCacheAddr[g_I2CCacheCount];
+			g_I2CCacheTTL[i] = g_I2CCacheTTL[g_I2CCacheCount];
+		}
+	}
+	else if(i < g_I2CCacheCount || g_I2CCacheCount < I2C_CACHE_TABLE_SIZE)
+	{
+		g_I2CCacheBus[i] = bus;
+		g_I2CCacheAddr[i] = addr;
+		g_I2CCacheTTL[i] = ((unsigned long)ttl << 15) / 1000;
+		if(i == g_I2CCacheCount)
+			g_I2CCacheCount++;
+	}
+	else
+		ret = 1;
+
+	// the cached registers were read with the old TTL
+	I2C_cache_invalidate(bus, addr, 0, 256);
+
+	__set_interrupt_state(state);
+	return ret;
+}
+
+void I2C_cache_stats(unsigned long* hits, unsigned long* misses)
+{
+	unsigned short state = __get_interrupt_state();
+
+	__disable_interrupt();
+	*hits = g_I2CCacheHits;
+	*misses = g_I2CCacheMisses;
+	__set_interrupt_state(state);
+}
+
+// TTL of the device in ACLK ticks, 0 if it is not cached
+static unsigned long I2C_cache_ttl(unsigned char bus, unsigned char addr)
+{
+	int i;
+
+	for(i = 0; i < g_I2CCacheCount; i++)
+	{
+		if(g_I2CCacheBus[i] == bus && g_I2CCacheAddr[i] == addr)
+			return g_I2CCacheTTL[i];
+	}
+
+	return 0;
+}
+
+// a complete register read which fits into an entry
+static int I2C_cacheable(I2C_transfer_t* transfer)
+{
+	return (transfer->flags & (I2C_FIRST | I2C_LAST)) == (I2C_FIRST | I2C_LAST)
+		&& transfer->txlen == 1 && transfer->rxlen && transfer->rxlen <= I2C_CACHE_DATA;
+}
+
+// answers a register read from the cache, returns 1 on a hit. The entries
+// a write changes are dropped by I2C_cache_update() once it has finished.
+// must be called with interrupts disabled
+static int I2C_cache_lookup(I2C_bus_t* bus, I2C_transfer_t* transfer)
+{
+	unsigned long now;
+	int i;
+
+	if(!I2C_cacheable(transfer) || !g_I2CCacheCount || !I2C_cache_ttl(transfer->bus, transfer->addr))
 		return 0;
 
-	// load data into globals
-	g_I2CCount = len;
-	g_pI2CData = RxData;
-	g_I2CError = 0;
+	// a hit must not overtake the transfers in the queue, one of them might
+	// write to the register. This is not counted as a miss.
+	if(bus->queue)
+		return 0;
 
-	// set slave address
-	UCB3I2CSA = addr;
+	now = I2C_clock();
 
-	if(len == 1)
+	for(i = 0; i < I2C_CACHE_ENTRIES; i++)
 	{
-		UCB3CTL1 &= ~UCTR;             			// I2C RX
-		UCB3CTL1 |= UCTXSTT;                    // I2C start condition
-		while(UCB3CTL1 & UCTXSTT);              // Start condition sent?
-		UCB3CTL1 |= UCTXSTP;                    // I2C stop condition
+		I2C_cache_entry_t* entry = &g_I2CCache[i];
 
-		__bis_SR_register(LPM0_bits + GIE);     // Enter LPM0, enable interrupts
+		if(entry->valid && entry->bus == transfer->bus && entry->addr == transfer->addr
+			&& entry->reg == transfer->txdata[0] && entry->len == transfer->rxlen
+			&& (long)(entry->expires - now) > 0)
+		{
+			memcpy(transfer->rxdata, entry->data, transfer->rxlen);
+			g_I2CCacheHits++;
+			return 1;
+		}
+	}
+
+	g_I2CCacheMisses++;
+	return 0;
+}
+
+// stores the result of a register read, drops the entries of the registers
+// which have been written to
+// called from the ISR
+static void I2C_cache_update(I2C_transfer_t* transfer, unsigned char status)
+{
+	I2C_cache_entry_t* entry = NULL;
+	unsigned long ttl;
+	unsigned long now;
+	int i;
+
+	if(!I2C_cacheable(transfer))
+	{
+		I2C_cache_written(transfer);
+		return;
+	}
+
+	if(status != I2C_OK || !g_I2CCacheCount)
+		return;
+
+	ttl = I2C_cache_ttl(transfer->bus, transfer->addr);
+	if(!ttl)
+		return;
+
+	now = I2C_clock();
+
+	// the entry of the register, else a free one, else the one which
+	// expires first
+	for(i = 0; i < I2C_CACHE_ENTRIES; i++)
+	{
+		I2C_cache_entry_t* e = &g_I2CCache[i];
+
+		if(e->valid && e->bus == transfer->bus && e->addr == transfer->addr
+			&& e->reg == transfer->txdata[0] && e->len == transfer->rxlen)
+		{
+			entry = e;
+			break;
+		}
+
+		if(!entry || (entry->valid && (!e->valid || (long)(e->expires - now) < (long)(entry->expires - now))))
+			entry = e;
+	}
+
+	entry->valid = 1;
+	entry->bus = transfer->bus;
+	entry->addr = transfer->addr;
+	entry->reg = transfer->txdata[0];
+	entry->len = transfer->rxlen;
+	entry->expires = now + ttl;
+	memcpy(entry->data, transfer->rxdata, transfer->rxlen);
+}
+
+// starts the write or read phase of the first transfer in the queue
+// must be called with interrupts disabled
+static void I2C_start_phase(I2C_bus_t* bus)
+{
+	I2C_transfer_t* transfer = bus->queue;
+
+	if(!bus->reading)
+	{
+		bus->data = transfer->txdata;
+		bus->count = transfer->txlen;
+
+		if(transfer->flags & I2C_FIRST)
+		{
+			// set slave address
+			I2C_SA(bus) = transfer->addr;
+
+			I2C_CTL1(bus) |= UCTR + UCTXSTT;         // I2C TX, start condition
+		}
+
+#ifdef I2C_DMA
+		// the ISR is called again when the DMA is done
+		if(I2C_dma_tx(bus))
+			return;
+#endif
+
+		// if this continues a transaction, TXIFG is still pending from the
+		// last part and fires as soon as the interrupt is enabled again
+		I2C_IE(bus) |= UCTXIE;
+	}
+	else
+	{
+		int last = (transfer->rxlen == 1 && (transfer->flags & I2C_LAST));
+
+		bus->data = transfer->rxdata;
+		bus->count = transfer->rxlen;
 
-		__no_operation();                       // For debugger
+		if((transfer->flags & I2C_FIRST) || transfer->txlen)
+		{
+			// set slave address
+			I2C_SA(bus) = transfer->addr;
+
+			I2C_CTL1(bus) &= ~UCTR;             			// I2C RX
+			I2C_CTL1(bus) |= UCTXSTT;                    // I2C start condition
+
+			// Start condition sent? a hanging bus is left to the timeout
+			if(last)
+				I2C_spin(bus, UCTXSTT);
+		}
+
+		// the stop condition has to be requested while the last byte is received
+		if(last)
+			I2C_CTL1(bus) |= UCTXSTP;                    // I2C stop condition
+
+#ifdef I2C_DMA
+		// the ISR is called again when the DMA is done
+		if(I2C_dma_rx(bus, transfer->flags & I2C_LAST))
+			return;
+#endif
+
+		// if this continues a transaction, the bus has been stalled with the
+		// next byte waiting in RXBUF
+		I2C_IE(bus) |= UCRXIE;
+	}
+}
+
+static void I2C_recover(I2C_bus_t* bus);
+
+// hands a finished transfer over to I2C_process() to run its callback
+// must be called with interrupts disabled
+static void I2C_done(I2C_transfer_t* transfer)
+{
+	if(transfer->callback)
+	{
+		transfer->next = NULL;
+		if(g_pI2CDone)
+			g_pI2CDoneTail->next = transfer;
+		else
+			g_pI2CDone = transfer;
+		g_pI2CDoneTail = transfer;
+	}
+}
+
+// starts the first transfer in the queue, transfers without data are
+// finished right away
+// must be called with interrupts disabled
+static void I2C_start_next(I2C_bus_t* bus)
+{
+	while(bus->queue)
+	{
+		I2C_transfer_t* transfer = bus->queue;
+
+		if(transfer->txlen || transfer->rxlen)
+		{
+			unsigned long timeout = I2C_TIMEOUT_BASE + (unsigned long)(transfer->txlen + transfer->rxlen) * I2C_TIMEOUT_PER_BYTE;
+
+			if(timeout > I2C_TIMEOUT_MAX)
+				timeout = I2C_TIMEOUT_MAX;
+
+			I2C_TIMER_CCR(transfer->bus) = I2C_time() + timeout;
+			I2C_TIMER_CTL(transfer->bus) = CCIE;
+
+			// a new transaction, nothing else is on the bus
+			if(transfer->flags & I2C_FIRST)
+				I2C_select_speed(bus, transfer->bus, transfer->addr);
+
+			bus->reading = (transfer->txlen == 0);
+			I2C_start_phase(bus);
+			return;
+		}
+
+		transfer->status = I2C_OK;
+
+		bus->queue = transfer->next;
+
+		I2C_done(transfer);
+	}
+}
+
+// finishes the transfer on the bus and starts the next one
+// called from the ISR
+static void I2C_complete(I2C_bus_t* bus, unsigned char status)
+{
+	I2C_transfer_t* transfer = bus->queue;
+
+	I2C_TIMER_CTL(transfer->bus) = 0;
+
+	I2C_cache_update(transfer, status);
+
+	bus->queue = transfer->next;
+
+	I2C_done(transfer);
+
+	transfer->status = status;
+	bus->held = (status == I2C_OK && !(transfer->flags & I2C_LAST));
+
+	if(bus->queue)
+	{
+		// a new start condition must not be requested before the stop
+		// condition of the last transfer has been sent
+		if(!I2C_spin(bus, UCTXSTP))
+			I2C_recover(bus);
+
+		I2C_start_next(bus);
+	}
+}
+
+// Frees a bus which hangs: the pins are taken away from the USCI and driven
+// by hand (open drain, the pull-ups pull the lines high). SCL is clocked
+// until the device releases SDA, at most 9 times, and a stop condition is
+// sent. Then the USCI is reinitialized.
+static void I2C_recover(I2C_bus_t* bus)
+{
+	int i;
+
+	I2C_CTL1(bus) |= UCSWRST;
+
+	I2C_PORT(bus->sda_port, I2C_PORT_OUT) &= ~bus->sda_pin;
+	I2C_PORT(bus->scl_port, I2C_PORT_OUT) &= ~bus->scl_pin;
+	I2C_PORT(bus->sda_port, I2C_PORT_DIR) &= ~bus->sda_pin;
+	I2C_PORT(bus->scl_port, I2C_PORT_DIR) &= ~bus->scl_pin;
+	I2C_PORT(bus->sda_port, I2C_PORT_SEL) &= ~bus->sda_pin;
+	I2C_PORT(bus->scl_port, I2C_PORT_SEL) &= ~bus->scl_pin;
+
+	for(i = 0; i < 9 && !(I2C_PORT(bus->sda_port, I2C_PORT_IN) & bus->sda_pin); i++)
+	{
+		I2C_PORT(bus->scl_port, I2C_PORT_DIR) |= bus->scl_pin;		// SCL low
+		__delay_cycles(I2C_RECOVERY_DELAY);
+		I2C_PORT(bus->scl_port, I2C_PORT_DIR) &= ~bus->scl_pin;		// SCL high
+		__delay_cycles(I2C_RECOVERY_DELAY);
+	}
+
+	// stop condition: SDA goes high while SCL is high
+	I2C_PORT(bus->scl_port, I2C_PORT_DIR) |= bus->scl_pin;
+	__delay_cycles(I2C_RECOVERY_DELAY);
+	I2C_PORT(bus->sda_port, I2C_PORT_DIR) |= bus->sda_pin;
+	__delay_cycles(I2C_RECOVERY_DELAY);
+	I2C_PORT(bus->scl_port, I2C_PORT_DIR) &= ~bus->scl_pin;
+	__delay_cycles(I2C_RECOVERY_DELAY);
+	I2C_PORT(bus->sda_port, I2C_PORT_DIR) &= ~bus->sda_pin;
+	__delay_cycles(I2C_RECOVERY_DELAY);
+
+	I2C_PORT(bus->sda_port, I2C_PORT_SEL) |= bus->sda_pin;
+	I2C_PORT(bus->scl_port, I2C_PORT_SEL) |= bus->scl_pin;
+
+	bus->held = 0;
+	I2C_reset(bus);
+}
+
+// aborts the transfer on a bus which has timed out
+// called from the ISR
+static void I2C_timeout(I2C_bus_t* bus)
+{
+#ifdef I2C_DMA
+	I2C_dma_stop(bus);
+#endif
+
+	I2C_recover(bus);
+
+	if(bus->queue)
+		I2C_complete(bus, I2C_TIMEOUT);
+}
+
+void I2C_submit(I2C_transfer_t* transfer)
+{
+	I2C_bus_t* bus = &g_I2CBus[transfer->bus];
+	unsigned short state = __get_interrupt_state();
+
+	transfer->status = I2C_PENDING;
+	transfer->next = NULL;
+
+	__disable_interrupt();
+
+	if(!I2C_bus_enabled(transfer->bus))
+	{
+		transfer->status = I2C_ERROR;
+		I2C_done(transfer);
+	}
+	else if(I2C_cache_lookup(bus, transfer))
+	{
+		transfer->status = I2C_OK;
+		I2C_done(transfer);
+	}
+	else if(bus->queue)
+	{
+		bus->tail->next = transfer;
+		bus->tail = transfer;
 	}
 	else
 	{
-		UCB3CTL1 &= ~UCTR;             			// I2C RX
-		UCB3CTL1 |= UCTXSTT;                    // I2C start condition
+		bus->queue = transfer;
+		bus->tail = transfer;
+		I2C_start_next(bus);
+	}
+
+	__set_interrupt_state(state);
+}
+
+// runs the callbacks of the finished transfers, called from the main loop
+void I2C_process()
+{
+	I2C_transfer_t* transfer;
+
+	while(g_pI2CDone)
+	{
+		__disable_interrupt();
+		transfer = g_pI2CDone;
+		g_pI2CDone = transfer->next;
+		__enable_interrupt();
 
+		transfer->callback(transfer);
+	}
+}
+
+static int I2C_busy()
+{
+	int i;
+
+	for(i = 0; i < I2C_BUS_COUNT; i++)
+	{
+		if(g_I2CBus[i].queue)
+			return 1;
+	}
+
+	return 0;
+}
+
+// true as long as a bus is in use or callbacks are waiting, SMCLK must not
+// be stopped then
+int I2C_pending()
+{
+	return I2C_busy() || g_pI2CDone != NULL;
+}
+
+// waits in LPM0 until the transfer has finished
+void I2C_wait_for(I2C_transfer_t* transfer)
+{
+	// interrupts are disabled between the check and entering LPM0, so the
+	// wakeup from the ISR can not get lost
+	__disable_interrupt();
+	while(transfer->status == I2C_PENDING)
+	{
 		__bis_SR_register(LPM0_bits + GIE);     // Enter LPM0, enable interrupts
+		__disable_interrupt();
+	}
+	__enable_interrupt();
+}
 
-		__no_operation();                       // Set breakpoint >>here<< and
+// waits until all submitted transfers have finished
+void I2C_wait()
+{
+	__disable_interrupt();
+	while(I2C_busy())
+	{
+		__bis_SR_register(LPM0_bits + GIE);     // Enter LPM0, enable interrupts
+		__disable_interrupt();
 	}
+	__enable_interrupt();
+}
+
+// submits the transfer and waits until it has finished
+int I2C_run(I2C_transfer_t* transfer)
+{
+	transfer->callback = NULL;
+
+	I2C_submit(transfer);
+	I2C_wait_for(transfer);
 
-	return g_I2CError;
+	return transfer->status != I2C_OK;
 }
 
+int I2C_write(unsigned char bus, unsigned char addr, unsigned char* TxData, unsigned int len)
+{
+	return I2C_write_part(bus, addr, TxData, len, I2C_FIRST | I2C_LAST);
+}
+
+int I2C_read(unsigned char bus, unsigned char addr, unsigned char* RxData, unsigned int len)
+{
+	return I2C_read_part(bus, addr, RxData, len, I2C_FIRST | I2C_LAST);
+}
+
+// writes e.g. a register address and reads from the device in one transaction
+int I2C_write_read(unsigned char bus, unsigned char addr, unsigned char* TxData, unsigned int txlen, unsigned char* RxData, unsigned int rxlen)
+{
+	I2C_transfer_t transfer = { 0 };
+
+	transfer.bus = bus;
+	transfer.addr = addr;
+	transfer.flags = I2C_FIRST | I2C_LAST;
+	transfer.txdata = TxData;
+	transfer.txlen = txlen;
+	transfer.rxdata = RxData;
+	transfer.rxlen = rxlen;
+
+	return I2C_run(&transfer);
+}
+
+int I2C_write_part(unsigned char bus, unsigned char addr, unsigned char* TxData, unsigned int len, unsigned char flags)
+{
+	I2C_transfer_t transfer = { 0 };
+
+	transfer.bus = bus;
+	transfer.addr = addr;
+	transfer.flags = flags;
+	transfer.txdata = TxData;
+	transfer.txlen = len;
+
+	return I2C_run(&transfer);
+}
+
+int I2C_read_part(unsigned char bus, unsigned char addr, unsigned char* RxData, unsigned int len, unsigned char flags)
+{
+	I2C_transfer_t transfer = { 0 };
+
+	transfer.bus = bus;
+	transfer.addr = addr;
+	transfer.flags = flags;
+	transfer.rxdata = RxData;
+	transfer.rxlen = len;
+
+	return I2C_run(&transfer);
+}
+
+// terminates a transaction which has been left open by a partial transfer
+void I2C_stop(unsigned char busnum)
+{
+	I2C_bus_t* bus = &g_I2CBus[busnum];
+
+	if(!I2C_bus_enabled(busnum) || !bus->held)
+		return;
+
+	bus->held = 0;
+
+	I2C_CTL1(bus) |= UCTXSTP;                    // I2C stop condition
+	if(!I2C_spin(bus, UCTXSTP))                  // wait until it has been sent
+	{
+		I2C_recover(bus);
+		return;
+	}
+	I2C_IFG(bus) &= ~(UCTXIFG + UCRXIFG);
+	I2C_IE(bus) |= UCTXIE + UCRXIE;
+}
+
+#ifdef I2C_DMA
 //------------------------------------------------------------------------------
-// The USCIAB0TX_ISR is structured such that it can be used to transmit any
-// number of bytes by pre-loading TXByteCtr with the byte count. Also, TXData
-// points to the next byte to transmit.
+// Called when the DMA has moved all bytes of a phase. The end of the TX phase
+// is handled by the USCI ISR as soon as the last byte has been sent, for the
+// RX phase the stop condition is requested and the last byte is left to the
+// USCI ISR.
 //------------------------------------------------------------------------------
-#pragma vector = USCI_B3_VECTOR
-__interrupt void USCI_B3_ISR(void)
+#pragma vector = DMA_VECTOR
+__interrupt void DMA_ISR(void)
+{
+	I2C_bus_t* bus = &g_I2CBus[I2C_DMA_BUS];
+
+	switch(__even_in_range(DMAIV,6))
+	{
+		case 4:                                   // Vector 4: DMA channel 1, TX
+			I2C_IE(bus) |= UCTXIE;
+			break;
+		case 6:                                   // Vector 6: DMA channel 2, RX
+			if(bus->count)
+			{
+				// one byte left
+				I2C_CTL1(bus) |= UCTXSTP;
+				I2C_IE(bus) |= UCRXIE;
+			}
+			else
+			{
+				// more parts follow: the next byte stays in RXBUF and stalls
+				// the bus until the next part is started
+				I2C_IE(bus) &= ~UCRXIE;
+				I2C_complete(bus, I2C_OK);
+				__bic_SR_register_on_exit(LPM0_bits); // Exit LPM0
+			}
+			break;
+		default:
+			break;
+	}
+}
+#endif
+
+//------------------------------------------------------------------------------
+// I2C_interrupt() runs the transfers in the queue of a bus. bus->count holds
+// the number of bytes left in the current phase and bus->data points to the
+// next byte. When a transfer is finished the next one in the queue is started.
+// Returns 1 if the CPU has to leave LPM0.
+//------------------------------------------------------------------------------
+static int I2C_interrupt(I2C_bus_t* bus)
 {
-	switch(__even_in_range(UCB3IV,12))
+	I2C_transfer_t* transfer = bus->queue;
+
+	switch(__even_in_range(I2C_IV(bus),12))
 	{
 		case  0:                                  // Vector  0: No interrupts
 			break;
@@ -96,47 +1076,165 @@ __interrupt void USCI_B3_ISR(void)
 			break;
 		case  4: 							      // Vector  4: NACKIFG
 			// NACK means the device did not respond => set error flag
-			g_I2CError = 1;
+#ifdef I2C_DMA
+			I2C_dma_stop(bus);
+#endif
+			I2C_CTL1(bus) |= UCTXSTP;                  // I2C stop condition
+			I2C_STAT(bus) &= ~UCNACKIFG;
 
-			UCB3CTL1 |= UCTXSTP;                  // I2C stop condition
-			UCB3STAT &= ~UCNACKIFG;
+			// the pending TXIFG must not start the next transfer
+			I2C_IFG(bus) &= ~UCTXIFG;
 
-			__bic_SR_register_on_exit(LPM0_bits); // Exit LPM0
-			break;
+			if(transfer)
+				I2C_complete(bus, I2C_ERROR);
+
+			return 1;
 		case  6:                                  // Vector  6: STTIFG
 			break;
 		case  8:                                  // Vector  8: STPIFG
 			break;
 		case 10:                                  // Vector 10: RXIFG
-			g_I2CCount--;                         // Decrement RX byte counter
-			if (g_I2CCount)
+			if(!transfer)
+				break;
+
+			bus->count--;                         // Decrement RX byte counter
+			if (bus->count)
 			{
-				*g_pI2CData++ = UCB3RXBUF;               // Move RX data to address PRxData
+				*bus->data++ = I2C_RXBUF(bus);               // Move RX data to address PRxData
 
 				// generate stop condition if only one byte is left
-				if(g_I2CCount == 1)
-					UCB3CTL1 |= UCTXSTP;                // Generate I2C stop condition
+				if(bus->count == 1 && (transfer->flags & I2C_LAST))
+					I2C_CTL1(bus) |= UCTXSTP;                // Generate I2C stop condition
 			}
 			else
 			{
-				*g_pI2CData = UCB3RXBUF;              // Move final RX data to PRxData
-				__bic_SR_register_on_exit(LPM0_bits); // Exit active CPU
+				*bus->data = I2C_RXBUF(bus);              // Move final RX data to PRxData
+
+				// more parts follow: the next byte stays in RXBUF and stalls
+				// the bus until the next part is started
+				if(!(transfer->flags & I2C_LAST))
+					I2C_IE(bus) &= ~UCRXIE;
+
+				I2C_complete(bus, I2C_OK);
+				return 1;
 			}
 			break;
 		case 12:                                    // Vector 12: TXIFG
-			if(g_I2CCount)                          // Check TX byte counter
+			if(!transfer)
+			{
+				I2C_IFG(bus) &= ~UCTXIFG;
+				break;
+			}
+
+			if(bus->count)                          // Check TX byte counter
 			{
-				UCB3TXBUF = *g_pI2CData++;             // Load TX buffer
-				g_I2CCount--;                          // Decrement TX byte counter
+				I2C_TXBUF(bus) = *bus->data++;             // Load TX buffer
+				bus->count--;                          // Decrement TX byte counter
+			}
+			else if(transfer->rxlen && !(transfer->flags & I2C_SPLIT))
+			{
+				// switch to the read phase with a repeated start condition
+				I2C_IFG(bus) &= ~UCTXIFG;                  // Clear USCI_B TX int flag
+				bus->reading = 1;
+				I2C_start_phase(bus);
+			}
+			else if((transfer->flags & I2C_LAST) || transfer->rxlen)
+			{
+				I2C_CTL1(bus) |= UCTXSTP;                  // I2C stop condition
+				I2C_IFG(bus) &= ~UCTXIFG;                  // Clear USCI_B TX int flag
+
+				if(transfer->rxlen)
+				{
+					// the read phase is started with a new start condition
+					// once the stop condition has been sent
+					I2C_spin(bus, UCTXSTP);
+					bus->reading = 1;
+					I2C_start_phase(bus);
+				}
+				else
+				{
+					I2C_complete(bus, I2C_OK);
+					return 1;
+				}
 			}
 			else
 			{
-				UCB3CTL1 |= UCTXSTP;                  // I2C stop condition
-				UCB3IFG &= ~UCTXIFG;                  // Clear USCI_B0 TX int flag
-				__bic_SR_register_on_exit(LPM0_bits); // Exit LPM0
+				// more parts follow: leave TXIFG pending and hold the bus
+				// until the next part is started
+				I2C_IE(bus) &= ~UCTXIE;
+				I2C_complete(bus, I2C_OK);
+				return 1;
 			}
 			break;
 		default:
 			break;
 	}
+
+	return 0;
+}
+
+#if I2C_BUSES & BIT0
+#pragma vector = USCI_B0_VECTOR
+__interrupt void USCI_B0_ISR(void)
+{
+	if(I2C_interrupt(&g_I2CBus[0]))
+		__bic_SR_register_on_exit(LPM0_bits); // Exit LPM0
+}
+#endif
+
+#if I2C_BUSES & BIT1
+#pragma vector = USCI_B1_VECTOR
+__interrupt void USCI_B1_ISR(void)
+{
+	if(I2C_interrupt(&g_I2CBus[1]))
+		__bic_SR_register_on_exit(LPM0_bits); // Exit LPM0
+}
+#endif
+
+#if I2C_BUSES & BIT2
+#pragma vector = USCI_B2_VECTOR
+__interrupt void USCI_B2_ISR(void)
+{
+	if(I2C_interrupt(&g_I2CBus[2]))
+		__bic_SR_register_on_exit(LPM0_bits); // Exit LPM0
+}
+#endif
+
+#if I2C_BUSES & BIT3
+#pragma vector = USCI_B3_VECTOR
+__interrupt void USCI_B3_ISR(void)
+{
+	if(I2C_interrupt(&g_I2CBus[3]))
+		__bic_SR_register_on_exit(LPM0_bits); // Exit LPM0
+}
+#endif
+
+//------------------------------------------------------------------------------
+// TB0 CCR1-CCR4: timeout of the transaction on bus 0-3, overflow: time of
+// the cache
+//------------------------------------------------------------------------------
+#pragma vector = TIMER0_B1_VECTOR
+__interrupt void I2C_TIMER_ISR(void)
+{
+	unsigned int iv = __even_in_range(TB0IV,14);
+
+	if(iv == 14)
+	{
+		g_I2CTimeHigh++;
+		return;
+	}
+
+	// CCR1-CCR4 are vectors 2-8
+	if(iv >= 2 && iv <= 8)
+	{
+		unsigned char busnum = (iv >> 1) - 1;
+
+		I2C_TIMER_CTL(busnum) = 0;
+
+		if(g_I2CBus[busnum].queue)
+		{
+			I2C_timeout(&g_I2CBus[busnum]);
+			__bic_SR_register_on_exit(LPM0_bits); // Exit LPM0
+		}
+	}
 }
@@ -1,8 +1,86 @@
 #ifndef I2C_LIB_H_
 #define I2C_LIB_H_
 
+// The USCI_B modules 0-3 are driven as separate buses which run their
+// transfers in parallel. I2C_BUSES selects the modules which are used
+// (bit n = UCBn), their pins are taken over by I2C_init():
+// bus 0: P3.1/P3.2, bus 1: P3.7/P5.4, bus 2: P9.1/P9.2, bus 3: P10.1/P10.2
+#ifndef I2C_BUSES
+#define I2C_BUSES		0x08
+#endif
+
+#define I2C_BUS_COUNT	4
+
+// the bus used by requests which do not name one
+#ifndef I2C_DEFAULT_BUS
+#define I2C_DEFAULT_BUS	3
+#endif
+
+// flags for the partial transfers
+#define I2C_FIRST	0x01	// generate a start condition before the data
+#define I2C_LAST	0x02	// generate a stop condition after the data
+#define I2C_SPLIT	0x04	// stop and start between the write and the read instead of a repeated start
+
+// bus speeds, set per device by I2C_set_speed(). Devices without an entry
+// in the speed table run at 100 kHz. 1 MHz is beyond what the USCI is
+// specified for and has to be tried with the device at hand.
+#define I2C_SPEED_100K	0
+#define I2C_SPEED_400K	1
+#define I2C_SPEED_1M	2
+#define I2C_SPEEDS		3
+
+// status of a transfer
+#define I2C_PENDING	0
+#define I2C_OK		1
+#define I2C_ERROR	2
+#define I2C_TIMEOUT	3	// the bus hung and has been recovered
+
+// A transfer writes txlen bytes and then reads rxlen bytes from the device,
+// either of them may be 0. The read follows the write with a repeated start
+// condition unless I2C_SPLIT is set. Transfers are queued per bus by
+// I2C_submit() and run one after another by the USCI interrupt, so the
+// caller does not have to wait.
+// The callback is run from the main loop by I2C_process() after the transfer
+// has finished, the transfer and its buffers have to stay valid until then.
+typedef struct I2C_transfer I2C_transfer_t;
+typedef void (*I2C_callback_t)(I2C_transfer_t* transfer);
+
+struct I2C_transfer
+{
+	unsigned char bus;
+	unsigned char addr;
+	unsigned char flags;
+	unsigned char* txdata;
+	unsigned int txlen;
+	unsigned char* rxdata;
+	unsigned int rxlen;
+	volatile unsigned char status;
+	I2C_callback_t callback;
+	I2C_transfer_t* next;
+};
+
 void I2C_init();
-int I2C_write(unsigned char addr, unsigned char* TxData, unsigned char len);
-int I2C_read(unsigned char addr, unsigned char* RxData, unsigned char len);
+int I2C_bus_enabled(unsigned char bus);
+int I2C_set_speed(unsigned char bus, unsigned char addr, unsigned char speed);
+int I2C_set_cache(unsigned char bus, unsigned char addr, unsigned int ttl);
+void I2C_cache_stats(unsigned long* hits, unsigned long* misses);
+void I2C_submit(I2C_transfer_t* transfer);
+void I2C_process();
+int I2C_pending();
+void I2C_wait();
+void I2C_wait_for(I2C_transfer_t* transfer);
+int I2C_run(I2C_transfer_t* transfer);
+
+// blocking transfers, they are queued behind the submitted transfers
+int I2C_write(unsigned char bus, unsigned char addr, unsigned char* TxData, unsigned int len);
+int I2C_read(unsigned char bus, unsigned char addr, unsigned char* RxData, unsigned int len);
+int I2C_write_read(unsigned char bus, unsigned char addr, unsigned char* TxData, unsigned int txlen, unsigned char* RxData, unsigned int rxlen);
+
+// partial transfers, a transaction can be split up into several parts which
+// are streamed from/into different buffers. The bus is held between the parts,
+// so no other transfer may be submitted to the bus until the last part.
+int I2C_write_part(unsigned char bus, unsigned char addr, unsigned char* TxData, unsigned int len, unsigned char flags);
+int I2C_read_part(unsigned char bus, unsigned char addr, unsigned char* RxData, unsigned int len, unsigned char flags);
+void I2C_stop(unsigned char bus);
 
 #endif
@@ -7,15 +7,81 @@
 
 
 #include "protocol.h"
+#include "flash.h"
 
 #include <stdio.h>
 #include <string.h>
 
 #define LOCAL_NAME		"Stone BT"
 
+   /* The HCI UART is opened at the rate the controller starts with and */
+   /* ramped up to HCI_TARGET_BAUD_RATE afterwards.  Every rate is      */
+   /* verified with an HCI command, if that fails the controller is     */
+   /* reset and the next lower rate of HCIBaudRates is tried.  A target */
+   /* of 115200 (or below) keeps the initial rate.                      */
+#ifndef HCI_TARGET_BAUD_RATE
+#define HCI_TARGET_BAUD_RATE                       (921600L)
+#endif
+
+#define HCI_BAUD_RATE_VERIFY_COUNT                 (3)
+
+   /* MTU which has to be assumed if the remote device does not send one*/
+#ifndef L2CAP_DEFAULT_MTU
+#define L2CAP_DEFAULT_MTU                          (672)
+#endif
+
+   /* PSMs of the server.  The channels of the control PSM run in basic */
+   /* mode, the channels of the data PSM request a segmenting mode for  */
+   /* bulk transfers (streaming or enhanced retransmission mode with a  */
+   /* tx window).  A host which rejects it is asked for the next lower  */
+   /* mode, down to basic mode.                                         */
+#define L2CAP_PSM_CONTROL                          (0x1001)
+#define L2CAP_PSM_DATA                             (0x1003)
 
-#define MAX_SUPPORTED_LINK_KEYS                    (1)   /* Max supported Link*/
-                                                         /* keys.             */
+#ifndef L2CAP_DATA_MODE
+#define L2CAP_DATA_MODE                            (L2CAP_MODE_INFO_MODE_STREAMING)
+#endif
+
+#define L2CAP_DATA_TX_WINDOW                       (8)
+#define L2CAP_DATA_MAX_TRANSMIT                    (4)
+#define L2CAP_DATA_RETRANSMISSION_TIMEOUT          (2000)   /* ms        */
+#define L2CAP_DATA_MONITOR_TIMEOUT                 (12000)  /* ms        */
+
+#define MAX_DATA_CHANNELS                          (2)
+
+#ifdef __SUPPORT_LOW_ENERGY__
+   /* GATT service of the bridge.  The requests are written to the      */
+   /* request characteristic in the same format as on the L2CAP         */
+   /* channels, answers and port events are notified on the response    */
+   /* characteristic once the client has enabled notifications.  The    */
+   /* UUIDs are given in little endian order.                           */
+#define BRIDGE_SERVICE_UUID_CONSTANT               { 0x3C, 0x8A, 0x55, 0x1E, 0x27, 0x5B, 0x4C, 0x93, 0xB1, 0x0D, 0x6F, 0x2E, 0x01, 0x00, 0x1B, 0x5A }
+#define BRIDGE_REQUEST_UUID_CONSTANT               { 0x3C, 0x8A, 0x55, 0x1E, 0x27, 0x5B, 0x4C, 0x93, 0xB1, 0x0D, 0x6F, 0x2E, 0x02, 0x00, 0x1B, 0x5A }
+#define BRIDGE_RESPONSE_UUID_CONSTANT              { 0x3C, 0x8A, 0x55, 0x1E, 0x27, 0x5B, 0x4C, 0x93, 0xB1, 0x0D, 0x6F, 0x2E, 0x03, 0x00, 0x1B, 0x5A }
+
+   /* Offsets of the attributes within the service table.               */
+#define BRIDGE_REQUEST_ATTRIBUTE_OFFSET            (2)
+#define BRIDGE_RESPONSE_ATTRIBUTE_OFFSET           (4)
+#define BRIDGE_RESPONSE_CCCD_ATTRIBUTE_OFFSET      (5)
+
+   /* Writes without response (ATT Write Commands) are reported as write*/
+   /* requests without a transaction, there is nobody to answer to.     */
+#define GATT_WRITE_WITHOUT_RESPONSE(_x)            (!((_x)->TransactionID))
+#endif
+
+
+#define MAX_SUPPORTED_LINK_KEYS                    (5)   /* Max supported Link*/
+                                                         /* keys, as many as  */
+                                                         /* fit into one info */
+                                                         /* flash segment.    */
+
+#define LINK_KEY_STORE_MAGIC                       (0x4C4B)
+
+   /* PIN which is used for legacy pairing (hosts without Secure Simple */
+   /* Pairing).                                                         */
+#ifndef PIN_CODE
+#define PIN_CODE                                   "0000"
+#endif
 
 #define FUNCTION_ERROR                             (-4)  /* Denotes that an   */
                                                          /* error occurred in */
@@ -54,6 +120,24 @@ typedef struct _tagLinkKeyInfo_t
    Link_Key_t LinkKey;
 } LinkKeyInfo_t;
 
+   /* The Link Keys are kept in the INFOB flash segment, so bonded hosts */
+   /* reconnect after a reset without pairing again.  The table is only */
+   /* valid if the magic word (which is written last) is present.       */
+typedef struct _tagLinkKeyStore_t
+{
+   Word_t        Magic;
+   LinkKeyInfo_t LinkKeyInfo[MAX_SUPPORTED_LINK_KEYS];
+} LinkKeyStore_t;
+
+   /* Mode which has been requested for a channel of the data PSM, kept */
+   /* while it is connected.                                            */
+typedef struct _tagDataChannel_t
+{
+   Word_t LCID;
+   Word_t InMTU;
+   Byte_t Mode;
+} DataChannel_t;
+
    /* User to represent a structure to hold a BD_ADDR return from       */
    /* BD_ADDRToStr.                                                     */
 typedef char BoardStr_t[15];
@@ -69,9 +153,75 @@ static unsigned int        BluetoothStackID;        /* Variable which holds the
                                                     /* Stack.                          */
 
 
+static DataChannel_t       DataChannel[MAX_DATA_CHANNELS];
+
 static LinkKeyInfo_t       LinkKeyInfo[MAX_SUPPORTED_LINK_KEYS]; /* Variable holds     */
                                                     /* BD_ADDR <-> Link Keys for       */
-                                                    /* pairing.                        */
+                                                    /* pairing, the newest key first.  */
+
+   /* The copy of LinkKeyInfo in flash is only changed by the flash     */
+   /* controller, so it is volatile and every read really goes to INFOB.*/
+   /* It must not be cleared by the startup code either (EABI zero      */
+   /* initializes uninitialized variables, COFF ABI does not).          */
+#pragma DATA_SECTION(LinkKeyStore, ".infoB")
+#ifdef __TI_EABI__
+#pragma NOINIT(LinkKeyStore)
+#endif
+static volatile const LinkKeyStore_t LinkKeyStore;  /* Copy of LinkKeyInfo in flash.   */
+
+#ifdef __SUPPORT_LOW_ENERGY__
+static unsigned int        GATTServiceID;           /* ID of the registered service.   */
+
+static BTPSCONST GATT_Primary_Service_128_Entry_t BridgeService =
+{
+   BRIDGE_SERVICE_UUID_CONSTANT
+};
+
+static BTPSCONST GATT_Characteristic_Declaration_128_Entry_t BridgeRequestDeclaration =
+{
+   (GATT_CHARACTERISTIC_PROPERTIES_WRITE | GATT_CHARACTERISTIC_PROPERTIES_WRITE_WITHOUT_RESPONSE),
+   BRIDGE_REQUEST_UUID_CONSTANT
+};
+
+static BTPSCONST GATT_Characteristic_Value_128_Entry_t BridgeRequestValue =
+{
+   BRIDGE_REQUEST_UUID_CONSTANT,
+   0,
+   NULL
+};
+
+static BTPSCONST GATT_Characteristic_Declaration_128_Entry_t BridgeResponseDeclaration =
+{
+   GATT_CHARACTERISTIC_PROPERTIES_NOTIFY,
+   BRIDGE_RESPONSE_UUID_CONSTANT
+};
+
+static BTPSCONST GATT_Characteristic_Value_128_Entry_t BridgeResponseValue =
+{
+   BRIDGE_RESPONSE_UUID_CONSTANT,
+   0,
+   NULL
+};
+
+static GATT_Characteristic_Descriptor_16_Entry_t BridgeResponseConfiguration =
+{
+   GATT_CLIENT_CONFIGURATION_CHARACTERISTIC_BLUETOOTH_UUID_CONSTANT,
+   GATT_CLIENT_CONFIGURATION_CHARACTERISTIC_DESCRIPTOR_LENGTH,
+   NULL
+};
+
+static BTPSCONST GATT_Service_Attribute_Entry_t BridgeServiceTable[] =
+{
+   { GATT_ATTRIBUTE_FLAGS_READABLE,          aetPrimaryService128,            (Byte_t *)&BridgeService               },
+   { GATT_ATTRIBUTE_FLAGS_READABLE,          aetCharacteristicDeclaration128, (Byte_t *)&BridgeRequestDeclaration    },
+   { GATT_ATTRIBUTE_FLAGS_WRITABLE,          aetCharacteristicValue128,       (Byte_t *)&BridgeRequestValue          },
+   { GATT_ATTRIBUTE_FLAGS_READABLE,          aetCharacteristicDeclaration128, (Byte_t *)&BridgeResponseDeclaration   },
+   { GATT_ATTRIBUTE_FLAGS_READABLE,          aetCharacteristicValue128,       (Byte_t *)&BridgeResponseValue         },
+   { GATT_ATTRIBUTE_FLAGS_READABLE_WRITABLE, aetDescriptor16,                 (Byte_t *)&BridgeResponseConfiguration }
+};
+
+#define BRIDGE_SERVICE_ATTRIBUTE_COUNT             (sizeof(BridgeServiceTable)/sizeof(GATT_Service_Attribute_Entry_t))
+#endif
 
 
    /* The following string table is used to map HCI Version information */
@@ -90,6 +240,19 @@ static BTPSCONST char *HCIVersionStrings[] =
 
 #define NUM_SUPPORTED_HCI_VERSIONS              (sizeof(HCIVersionStrings)/sizeof(char *) - 1)
 
+   /* The following table holds the rates which are tried after         */
+   /* HCI_TARGET_BAUD_RATE, fastest first.                              */
+static BTPSCONST DWord_t HCIBaudRates[] =
+{
+   3000000L,
+   2000000L,
+   921600L,
+   460800L,
+   230400L
+} ;
+
+#define NUM_HCI_BAUD_RATES                      (sizeof(HCIBaudRates)/sizeof(DWord_t))
+
    /* Internal function prototypes.                                     */
 static void BD_ADDRToStr(BD_ADDR_t Board_Address, BoardStr_t BoardStr);
 
@@ -97,15 +260,34 @@ static int OpenStack(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_Initia
 static int CloseStack(void);
 
 static int SetConnect(void);
+static int SetPairable(void);
 static int DeleteLinkKey(BD_ADDR_t BD_ADDR);
+static void LoadLinkKeys(void);
+static void SaveLinkKeys(void);
+static int FindLinkKey(BD_ADDR_t BD_ADDR);
+static void StoreLinkKey(BD_ADDR_t BD_ADDR, Link_Key_t *LinkKey);
 
 static int SetLocalName(char* name);
 
 static int SetBaudRate(SDWord_t baudrate);
+static int VerifyBaudRate(void);
+static int RampBaudRate(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_Initialization_t *BTPS_Initialization);
+
+#ifdef __SUPPORT_LOW_ENERGY__
+static int AdvertiseLE();
+static int RegisterGATTService(void);
+#endif
 
    /* BTPS Callback function prototypes.                                */
+static void BTPSAPI GAP_Event_Callback(unsigned int BluetoothStackID, GAP_Event_Data_t *GAP_Event_Data, unsigned long CallbackParameter);
 static void BTPSAPI L2CAP_Event_Callback(unsigned int BluetoothStackID, L2CA_Event_Data_t *L2CA_Event_Data, unsigned long CallbackParameter);
 
+#ifdef __SUPPORT_LOW_ENERGY__
+static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_Event_Data_t *GAP_LE_Event_Data, unsigned long CallbackParameter);
+static void BTPSAPI GATT_Connection_Event_Callback(unsigned int BluetoothStackID, GATT_Connection_Event_Data_t *GATT_Connection_Event_Data, unsigned long CallbackParameter);
+static void BTPSAPI GATT_Server_Event_Callback(unsigned int BluetoothStackID, GATT_Server_Event_Data_t *GATT_ServerEventData, unsigned long CallbackParameter);
+#endif
+
    /* The following function is responsible for converting data of type */
    /* BD_ADDR to a string.  The first parameter of this function is the */
    /* BD_ADDR to be converted to a string.  The second parameter of this*/
@@ -179,10 +361,8 @@ static int OpenStack(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_Initia
             if(HCI_Command_Supported(BluetoothStackID, HCI_SUPPORTED_COMMAND_WRITE_DEFAULT_LINK_POLICY_BIT_NUMBER) > 0)
                HCI_Write_Default_Link_Policy_Settings(BluetoothStackID, (HCI_LINK_POLICY_SETTINGS_ENABLE_MASTER_SLAVE_SWITCH|HCI_LINK_POLICY_SETTINGS_ENABLE_SNIFF_MODE), &Status);
 
-            /* Delete all Stored Link Keys.                             */
-            ASSIGN_BD_ADDR(BD_ADDR, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-
-            DeleteLinkKey(BD_ADDR);
+            /* Load the Link Keys of the bonded hosts.                  */
+            LoadLinkKeys();
          }
          else
          {
@@ -311,6 +491,36 @@ static int SetConnect(void)
 	return ret_val;
 }
 
+   /* The following function is responsible for making the local device*/
+   /* pairable and registering the callback which answers the link key */
+   /* and pairing requests of the hosts.  This function returns zero on */
+   /* successful execution and a negative value on all errors.          */
+static int SetPairable(void)
+{
+	int ret_val = 0;
+
+	/* First, check that a valid Bluetooth Stack ID exists.              */
+	if(BluetoothStackID)
+	{
+		ret_val = GAP_Set_Pairability_Mode(BluetoothStackID, pmPairableMode_EnableSecureSimplePairing);
+		if(!ret_val)
+		{
+			ret_val = GAP_Register_Remote_Authentication(BluetoothStackID, GAP_Event_Callback, 0);
+			if(ret_val)
+				LOG_ERROR(("GAP_Register_Remote_Authentication failed with error code %d\r\n", ret_val));
+		}
+		else
+			LOG_ERROR(("Set Pairability Mode failed with error code %d\r\n", ret_val));
+	}
+	else
+	{
+		/* No valid Bluetooth Stack ID exists.                            */
+		ret_val = INVALID_STACK_ID_ERROR;
+	}
+
+	return ret_val;
+}
+
    /* The following function is a utility function that exists to delete*/
    /* the specified Link Key from the Local Bluetooth Device.  If a NULL*/
    /* Bluetooth Device Address is specified, then all Link Keys will be */
@@ -341,16 +551,83 @@ static int DeleteLinkKey(BD_ADDR_t BD_ADDR)
 		{
 			if(COMPARE_BD_ADDR(BD_ADDR, LinkKeyInfo[Result].BD_ADDR))
 			{
-				LinkKeyInfo[Result].BD_ADDR = NULL_BD_ADDR;
+				/* The key itself is cleared as well, it must not stay in         */
+				/* RAM and flash.                                                 */
+				BTPS_MemInitialize(&LinkKeyInfo[Result], 0, sizeof(LinkKeyInfo_t));
 
 				break;
 			}
 		}
 	}
 
+	/* Keep the copy in flash in sync as well.                           */
+	SaveLinkKeys();
+
 	return(Result);
 }
 
+   /* The following function loads the Link Keys which have been stored */
+   /* in flash, an invalid (e.g. erased) table holds no keys.           */
+static void LoadLinkKeys(void)
+{
+	if(LinkKeyStore.Magic == LINK_KEY_STORE_MAGIC)
+		BTPS_MemCopy(LinkKeyInfo, (const void *)LinkKeyStore.LinkKeyInfo, sizeof(LinkKeyInfo));
+	else
+		BTPS_MemInitialize(LinkKeyInfo, 0, sizeof(LinkKeyInfo));
+}
+
+   /* The following function writes the Link Keys to flash, if they have*/
+   /* changed.  The magic word is written last, so a write which is     */
+   /* interrupted by a reset leaves an invalid table behind rather than */
+   /* a corrupted one.                                                  */
+static void SaveLinkKeys(void)
+{
+	Word_t Magic = LINK_KEY_STORE_MAGIC;
+
+	if((LinkKeyStore.Magic == LINK_KEY_STORE_MAGIC) && (!memcmp((const void *)LinkKeyStore.LinkKeyInfo, LinkKeyInfo, sizeof(LinkKeyInfo))))
+		return;
+
+	flash_erase((const void *)&LinkKeyStore);
+	flash_write((const void *)LinkKeyStore.LinkKeyInfo, LinkKeyInfo, sizeof(LinkKeyInfo));
+	flash_write((const void *)&LinkKeyStore.Magic, &Magic, sizeof(Magic));
+}
+
+   /* The following function returns the index of the Link Key of the   */
+   /* given device or a negative value if there is none.                */
+static int FindLinkKey(BD_ADDR_t BD_ADDR)
+{
+	int Index;
+
+	for(Index=0;Index<MAX_SUPPORTED_LINK_KEYS;Index++)
+	{
+		if(COMPARE_BD_ADDR(BD_ADDR, LinkKeyInfo[Index].BD_ADDR))
+			return(Index);
+	}
+
+	return(-1);
+}
+
+   /* The following function adds a new Link Key as first entry, the    */
+   /* others move down.  A known device gives up its old entry, else the*/
+   /* oldest key is dropped if the table is full.                       */
+static void StoreLinkKey(BD_ADDR_t BD_ADDR, Link_Key_t *LinkKey)
+{
+	int Index;
+
+	for(Index=0;Index<MAX_SUPPORTED_LINK_KEYS-1;Index++)
+	{
+		if(COMPARE_BD_ADDR(BD_ADDR, LinkKeyInfo[Index].BD_ADDR))
+			break;
+	}
+
+	memmove(&LinkKeyInfo[1], &LinkKeyInfo[0], Index * sizeof(LinkKeyInfo_t));
+
+	LinkKeyInfo[0].BD_ADDR = BD_ADDR;
+	LinkKeyInfo[0].LinkKey = *LinkKey;
+
+	SaveLinkKeys();
+}
+
    /* The following function is responsible for setting the name of the */
    /* local Bluetooth Device to a specified name.  This function returns*/
    /* zero on successful execution and a negative value on all errors.  */
@@ -470,6 +747,76 @@ static int SetBaudRate(SDWord_t baudrate)
    return(ret_val);
 }
 
+   /* The following function checks that the controller answers at the */
+   /* current rate of the HCI UART.  This function returns zero if it   */
+   /* does and a negative value otherwise.                              */
+static int VerifyBaudRate(void)
+{
+   int    Index;
+   Byte_t Status;
+   Byte_t HCI_Version;
+   Word_t HCI_Revision;
+   Byte_t LMP_Version;
+   Word_t Manufacturer_Name;
+   Word_t LMP_Subversion;
+
+   for(Index=0;Index<HCI_BAUD_RATE_VERIFY_COUNT;Index++)
+   {
+      if((HCI_Read_Local_Version_Information(BluetoothStackID, &Status, &HCI_Version, &HCI_Revision, &LMP_Version, &Manufacturer_Name, &LMP_Subversion)) || (Status))
+         return(FUNCTION_ERROR);
+   }
+
+   return(0);
+}
+
+   /* The following function ramps the HCI UART up to the fastest rate  */
+   /* (up to HCI_TARGET_BAUD_RATE) at which the controller answers.  If */
+   /* the link fails at a rate, the stack is reopened, which resets the */
+   /* controller to its initial rate, and the next rate is tried.  This */
+   /* function returns zero if the stack is open (at whatever rate) and */
+   /* a negative value if it could not be reopened.                     */
+static int RampBaudRate(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_Initialization_t *BTPS_Initialization)
+{
+   int      Index;
+   DWord_t  BaudRate;
+   DWord_t  InitialRate = HCI_DriverInformation->DriverInformation.COMMDriverInformation.BaudRate;
+
+   for(Index=-1;Index<(int)NUM_HCI_BAUD_RATES;Index++)
+   {
+      /* The target comes first, then the slower rates of the table.    */
+      BaudRate = (Index < 0)?HCI_TARGET_BAUD_RATE:HCIBaudRates[Index];
+
+      if((BaudRate <= InitialRate) || ((Index >= 0) && (BaudRate >= HCI_TARGET_BAUD_RATE)))
+         continue;
+
+      if(!SetBaudRate(BaudRate))
+      {
+         if(!VerifyBaudRate())
+         {
+            Display(("HCI UART runs at %lu baud.\r\n", BaudRate));
+
+            return(0);
+         }
+      }
+      else
+      {
+         /* The controller refused the rate and still runs at the old   */
+         /* one, if it answers there.                                   */
+         if(!VerifyBaudRate())
+            continue;
+      }
+
+      Display(("HCI UART failed at %lu baud, resetting the controller.\r\n", BaudRate));
+
+      CloseStack();
+
+      if(OpenStack(HCI_DriverInformation, BTPS_Initialization))
+         return(UNABLE_TO_INITIALIZE_STACK);
+   }
+
+   return(0);
+}
+
 
 #ifdef __SUPPORT_LOW_ENERGY__
 /* The following function is responsible for enabling LE             */
@@ -501,8 +848,14 @@ static int AdvertiseLE()
 		/* Configure the flags field based on the Discoverability Mode.   */
 		Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[2] = HCI_LE_ADVERTISING_FLAGS_GENERAL_DISCOVERABLE_MODE_FLAGS_BIT_MASK;
 
+		/* Add the UUID of the bridge service, so clients can filter for */
+		/* it while scanning.                                             */
+		Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[3] = (Byte_t)(1 + sizeof(UUID_128_t));
+		Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[4] = HCI_LE_ADVERTISING_REPORT_DATA_TYPE_128_BIT_SERVICE_UUID_COMPLETE;
+		BTPS_MemCopy(&(Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[5]), &BridgeService, sizeof(UUID_128_t));
+
 		/* Write thee advertising data to the chip.                       */
-		ret_val = GAP_LE_Set_Advertising_Data(BluetoothStackID, (Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[0] + 1), &(Advertisement_Data_Buffer.AdvertisingData));
+		ret_val = GAP_LE_Set_Advertising_Data(BluetoothStackID, (3 + Advertisement_Data_Buffer.AdvertisingData.Advertising_Data[3] + 1), &(Advertisement_Data_Buffer.AdvertisingData));
 		if(!ret_val)
 		{
 			BTPS_MemInitialize(&(Advertisement_Data_Buffer.ScanResponseData), 0, sizeof(Scan_Response_Data_t));
@@ -577,55 +930,396 @@ static int AdvertiseLE()
 
 	return ret_val;
 }
+
+   /* The following function initializes GATT and registers the bridge  */
+   /* service.  This function returns zero on successful execution and  */
+   /* a negative value on all errors.                                   */
+static int RegisterGATTService(void)
+{
+	int                           ret_val;
+	GATT_Attribute_Handle_Group_t ServiceHandleGroup;
+
+	ret_val = GATT_Initialize(BluetoothStackID, GATT_INITIALIZATION_FLAGS_SUPPORT_LE, GATT_Connection_Event_Callback, 0);
+	if(!ret_val)
+	{
+		ret_val = GATT_Register_Service(BluetoothStackID, GATT_SERVICE_FLAGS_LE_SERVICE, BRIDGE_SERVICE_ATTRIBUTE_COUNT, (GATT_Service_Attribute_Entry_t *)BridgeServiceTable, &ServiceHandleGroup, GATT_Server_Event_Callback, 0);
+		if(ret_val > 0)
+		{
+			GATTServiceID = (unsigned int)ret_val;
+
+			LOG_INFO(("GATT service registered, handles 0x%04X - 0x%04X.\r\n", ServiceHandleGroup.Starting_Handle, ServiceHandleGroup.Ending_Handle));
+
+			ret_val = 0;
+		}
+		else
+		{
+			LOG_ERROR(("GATT_Register_Service returned %d.\r\n", ret_val));
+
+			GATT_Cleanup(BluetoothStackID);
+
+			ret_val = FUNCTION_ERROR;
+		}
+	}
+	else
+	{
+		LOG_ERROR(("GATT_Initialize returned %d.\r\n", ret_val));
+
+		ret_val = FUNCTION_ERROR;
+	}
+
+	return ret_val;
+}
+
+   /* Notifies a frame of the protocol on the response characteristic.  */
+   /* Returns zero on success, BTPS_ERROR_INSUFFICIENT_RESOURCES if the  */
+   /* stack has no room for it or another negative error code.          */
+int NotifyGATT(unsigned int ConnectionID, Word_t Length, Byte_t *Value)
+{
+	int ret_val;
+
+	/* The client has not subscribed to the responses.                   */
+	if(!(gattConfiguration(ConnectionID) & GATT_CLIENT_CONFIGURATION_CHARACTERISTIC_NOTIFY_ENABLE))
+		return FUNCTION_ERROR;
+
+	ret_val = GATT_Handle_Value_Notification(BluetoothStackID, GATTServiceID, ConnectionID, BRIDGE_RESPONSE_ATTRIBUTE_OFFSET, Length, Value);
+
+	/* The number of bytes which have been queued is returned on success.*/
+	return (ret_val < 0) ? ret_val : 0;
+}
 #endif
 
 /*********************************************************************/
 /*                         Event Callbacks                           */
 /*********************************************************************/
 
+#ifdef __SUPPORT_LOW_ENERGY__
+   /* GAP LE Event Callback.  Advertising stops while a client is        */
+   /* connected, so it is enabled again after the connection is gone.   */
+static void BTPSAPI GAP_LE_Event_Callback(unsigned int BluetoothStackID, GAP_LE_Event_Data_t *GAP_LE_Event_Data, unsigned long CallbackParameter)
+{
+	switch(GAP_LE_Event_Data->Event_Data_Type)
+	{
+	case etLE_Connection_Complete:
+		LOG_INFO(("LE: Connection complete, status %d\r\n", GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Status));
+
+		if(GAP_LE_Event_Data->Event_Data.GAP_LE_Connection_Complete_Event_Data->Status)
+			AdvertiseLE();
+		break;
+
+	case etLE_Disconnection_Complete:
+		LOG_INFO(("LE: Disconnection complete, reason %d\r\n", GAP_LE_Event_Data->Event_Data.GAP_LE_Disconnection_Complete_Event_Data->Reason));
+
+		AdvertiseLE();
+		break;
+
+	default:
+		break;
+	}
+}
+
+   /* GATT Connection Event Callback.  The LE connection is handed to    */
+   /* the protocol like an L2CAP channel.                               */
+static void BTPSAPI GATT_Connection_Event_Callback(unsigned int BluetoothStackID, GATT_Connection_Event_Data_t *GATT_Connection_Event_Data, unsigned long CallbackParameter)
+{
+	switch(GATT_Connection_Event_Data->Event_Data_Type)
+	{
+	case etGATT_Connection_Device_Connection:
+		if(GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->ConnectionType != gctLE)
+			break;
+
+		LOG_INFO(("GATT: Client connected, MTU %d\r\n", GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->MTU));
+
+		if(!gattOpened(BluetoothStackID, GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->ConnectionID, GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->RemoteDevice, GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->MTU))
+			GAP_LE_Disconnect(BluetoothStackID, GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_Data->RemoteDevice);
+		break;
+
+	case etGATT_Connection_Device_Disconnection:
+		if(GATT_Connection_Event_Data->Event_Data.GATT_Device_Disconnection_Data->ConnectionType != gctLE)
+			break;
+
+		LOG_INFO(("GATT: Client disconnected\r\n"));
+
+		gattClosed(GATT_Connection_Event_Data->Event_Data.GATT_Device_Disconnection_Data->ConnectionID);
+		break;
+
+	case etGATT_Connection_Device_Connection_MTU_Update:
+		LOG_DEBUG(("GATT: MTU %d\r\n", GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_MTU_Update_Data->MTU));
+
+		gattMTU(GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_MTU_Update_Data->ConnectionID, GATT_Connection_Event_Data->Event_Data.GATT_Device_Connection_MTU_Update_Data->MTU);
+		break;
+
+	case etGATT_Connection_Device_Buffer_Empty:
+		// notifications which did not fit are sent again
+		gattTxReady(GATT_Connection_Event_Data->Event_Data.GATT_Device_Buffer_Empty_Data->ConnectionID);
+		break;
+
+	default:
+		break;
+	}
+}
+
+   /* GATT Server Event Callback of the bridge service.  A request has to*/
+   /* fit into a single write, long (prepared) writes are refused.      */
+static void BTPSAPI GATT_Server_Event_Callback(unsigned int BluetoothStackID, GATT_Server_Event_Data_t *GATT_ServerEventData, unsigned long CallbackParameter)
+{
+	GATT_Write_Request_Data_t *WriteRequest;
+	GATT_Read_Request_Data_t  *ReadRequest;
+	Byte_t                     Value[GATT_CLIENT_CONFIGURATION_CHARACTERISTIC_DESCRIPTOR_LENGTH];
+
+	switch(GATT_ServerEventData->Event_Data_Type)
+	{
+	case etGATT_Server_Write_Request:
+		WriteRequest = GATT_ServerEventData->Event_Data.GATT_Write_Request_Data;
+
+		if((WriteRequest->AttributeValueOffset) || (WriteRequest->DelayWrite))
+		{
+			GATT_Error_Response(BluetoothStackID, WriteRequest->TransactionID, WriteRequest->AttributeOffset, ATT_PROTOCOL_ERROR_CODE_ATTRIBUTE_NOT_LONG);
+			break;
+		}
+
+		if(WriteRequest->AttributeOffset == BRIDGE_REQUEST_ATTRIBUTE_OFFSET)
+		{
+			gattReceived(WriteRequest->ConnectionID, WriteRequest->AttributeValue, WriteRequest->AttributeValueLength);
+		}
+		else if(WriteRequest->AttributeOffset == BRIDGE_RESPONSE_CCCD_ATTRIBUTE_OFFSET)
+		{
+			if(WriteRequest->AttributeValueLength != GATT_CLIENT_CONFIGURATION_CHARACTERISTIC_DESCRIPTOR_LENGTH)
+			{
+				GATT_Error_Response(BluetoothStackID, WriteRequest->TransactionID, WriteRequest->AttributeOffset, ATT_PROTOCOL_ERROR_CODE_INVALID_ATTRIBUTE_VALUE_LENGTH);
+				break;
+			}
+
+			gattConfigure(WriteRequest->ConnectionID, READ_UNALIGNED_WORD_LITTLE_ENDIAN(WriteRequest->AttributeValue));
+		}
+
+		/* A write without response (ATT Write Command) must not be       */
+		/* answered.                                                      */
+		if(!GATT_WRITE_WITHOUT_RESPONSE(WriteRequest))
+			GATT_Write_Response(BluetoothStackID, WriteRequest->TransactionID);
+		break;
+
+	case etGATT_Server_Read_Request:
+		ReadRequest = GATT_ServerEventData->Event_Data.GATT_Read_Request_Data;
+
+		if(ReadRequest->AttributeOffset == BRIDGE_RESPONSE_CCCD_ATTRIBUTE_OFFSET)
+		{
+			ASSIGN_HOST_WORD_TO_LITTLE_ENDIAN_UNALIGNED_WORD(Value, gattConfiguration(ReadRequest->ConnectionID));
+			GATT_Read_Response(BluetoothStackID, ReadRequest->TransactionID, GATT_CLIENT_CONFIGURATION_CHARACTERISTIC_DESCRIPTOR_LENGTH, Value);
+		}
+		else
+			GATT_Read_Response(BluetoothStackID, ReadRequest->TransactionID, 0, NULL);
+		break;
+
+	default:
+		break;
+	}
+}
+#endif
+
+   /* GAP Event Callback, answers the authentication requests of the    */
+   /* hosts.  A bonded host gets its stored Link Key, otherwise it has  */
+   /* to pair.  There is neither a display nor a keyboard, so Secure    */
+   /* Simple Pairing runs as Just Works, legacy pairing uses PIN_CODE.  */
+static void BTPSAPI GAP_Event_Callback(unsigned int BluetoothStackID, GAP_Event_Data_t *GAP_Event_Data, unsigned long CallbackParameter)
+{
+	int                               Index;
+	BoardStr_t                        BoardStr;
+	GAP_Authentication_Event_Data_t  *AuthenticationEventData;
+	GAP_Authentication_Information_t  AuthenticationInformation;
+
+	if(GAP_Event_Data->Event_Data_Type != etAuthentication)
+		return;
+
+	AuthenticationEventData = GAP_Event_Data->Event_Data.GAP_Authentication_Event_Data;
+
+	BTPS_MemInitialize(&AuthenticationInformation, 0, sizeof(GAP_Authentication_Information_t));
+
+	BD_ADDRToStr(AuthenticationEventData->Remote_Device, BoardStr);
+
+	switch(AuthenticationEventData->GAP_Authentication_Event_Type)
+	{
+	case atLinkKeyRequest:
+		LOG_DEBUG(("GAP: Link Key Request %s\r\n", BoardStr));
+
+		/* A response without data tells the host there is no key.        */
+		AuthenticationInformation.GAP_Authentication_Type = atLinkKey;
+
+		if((Index = FindLinkKey(AuthenticationEventData->Remote_Device)) >= 0)
+		{
+			AuthenticationInformation.Authentication_Data_Length   = sizeof(Link_Key_t);
+			AuthenticationInformation.Authentication_Data.Link_Key = LinkKeyInfo[Index].LinkKey;
+		}
+
+		GAP_Authentication_Response(BluetoothStackID, AuthenticationEventData->Remote_Device, &AuthenticationInformation);
+		break;
+
+	case atPINCodeRequest:
+		LOG_DEBUG(("GAP: PIN Code Request %s\r\n", BoardStr));
+
+		AuthenticationInformation.GAP_Authentication_Type    = atPINCode;
+		AuthenticationInformation.Authentication_Data_Length = (Byte_t)BTPS_StringLength(PIN_CODE);
+
+		BTPS_MemCopy(&(AuthenticationInformation.Authentication_Data.PIN_Code), PIN_CODE, AuthenticationInformation.Authentication_Data_Length);
+
+		GAP_Authentication_Response(BluetoothStackID, AuthenticationEventData->Remote_Device, &AuthenticationInformation);
+		break;
+
+	case atIOCapabilityRequest:
+		LOG_DEBUG(("GAP: IO Capability Request %s\r\n", BoardStr));
+
+		AuthenticationInformation.GAP_Authentication_Type                                      = atIOCapabilities;
+		AuthenticationInformation.Authentication_Data_Length                                   = sizeof(GAP_IO_Capabilities_t);
+		AuthenticationInformation.Authentication_Data.IO_Capabilities.IO_Capability            = icNoInputNoOutput;
+		AuthenticationInformation.Authentication_Data.IO_Capabilities.OOB_Data_Present         = FALSE;
+		AuthenticationInformation.Authentication_Data.IO_Capabilities.MITM_Protection_Required = FALSE;
+		AuthenticationInformation.Authentication_Data.IO_Capabilities.Bonding_Type             = ibGeneralBonding;
+
+		GAP_Authentication_Response(BluetoothStackID, AuthenticationEventData->Remote_Device, &AuthenticationInformation);
+		break;
+
+	case atUserConfirmationRequest:
+		LOG_DEBUG(("GAP: User Confirmation Request %s\r\n", BoardStr));
+
+		AuthenticationInformation.GAP_Authentication_Type          = atUserConfirmation;
+		AuthenticationInformation.Authentication_Data_Length       = sizeof(Byte_t);
+		AuthenticationInformation.Authentication_Data.Confirmation = TRUE;
+
+		GAP_Authentication_Response(BluetoothStackID, AuthenticationEventData->Remote_Device, &AuthenticationInformation);
+		break;
+
+	case atLinkKeyCreation:
+		LOG_INFO(("GAP: Bonded with %s\r\n", BoardStr));
+
+		StoreLinkKey(AuthenticationEventData->Remote_Device, &(AuthenticationEventData->Authentication_Event_Data.Link_Key_Info.Link_Key));
+		break;
+
+	case atAuthenticationStatus:
+		if(AuthenticationEventData->Authentication_Event_Data.Authentication_Status != HCI_ERROR_CODE_NO_ERROR)
+			LOG_ERROR(("GAP: Authentication of %s failed: %d\r\n", BoardStr, AuthenticationEventData->Authentication_Event_Data.Authentication_Status));
+
+		/* The host has dropped the bond if it rejects our key or has     */
+		/* none, it pairs again on the next connection.  Other errors     */
+		/* (e.g. a lost link) leave the key alone.                        */
+		if((AuthenticationEventData->Authentication_Event_Data.Authentication_Status == HCI_ERROR_CODE_AUTHENTICATION_FAILURE) ||
+		   (AuthenticationEventData->Authentication_Event_Data.Authentication_Status == HCI_ERROR_CODE_KEY_MISSING))
+		{
+			if(FindLinkKey(AuthenticationEventData->Remote_Device) >= 0)
+				DeleteLinkKey(AuthenticationEventData->Remote_Device);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+   /* Fills in the mode option of a Config Request or Response.         */
+static void SetModeInfo(L2CA_Mode_Info_t *ModeInfo, Word_t InMTU, Byte_t Mode)
+{
+	ModeInfo->Mode       = Mode;
+	ModeInfo->MaxPDUSize = InMTU;
+
+	// streaming mode does not retransmit, the other fields are 0 there
+	if(Mode == L2CAP_MODE_INFO_MODE_ENHANCED_RETRANSMISSION)
+	{
+		ModeInfo->TxWindowSize          = L2CAP_DATA_TX_WINDOW;
+		ModeInfo->MaxTransmitAttempts   = L2CAP_DATA_MAX_TRANSMIT;
+		ModeInfo->RetransmissionTimeout = L2CAP_DATA_RETRANSMISSION_TIMEOUT;
+		ModeInfo->MonitorTimeout        = L2CAP_DATA_MONITOR_TIMEOUT;
+	}
+}
+
+   /* Sends the Config Request for a channel which has been accepted.  */
+   /* Any other mode than basic mode adds the mode option.              */
+static int SendConfigRequest(unsigned int BluetoothStackID, Word_t LCID, Word_t InMTU, Byte_t Mode)
+{
+	L2CA_Config_Request_t ConfigRequest;
+
+	memset(&ConfigRequest, 0, sizeof(L2CA_Config_Request_t));
+
+	/* Set the desired MTU.  This will tell the remote device what the   */
+	/* Maximum packet size that are capable if receiving.                */
+	ConfigRequest.Option_Flags = L2CA_CONFIG_OPTION_FLAG_MTU;
+	ConfigRequest.InMTU        = InMTU;
+
+	if(Mode != L2CAP_MODE_INFO_MODE_BASIC)
+	{
+		ConfigRequest.Option_Flags |= L2CA_CONFIG_OPTION_FLAG_MODE_INFO;
+		SetModeInfo(&ConfigRequest.ModeInfo, InMTU, Mode);
+	}
+
+	return L2CA_Config_Request(BluetoothStackID, LCID, L2CAP_LINK_TIMEOUT_MAXIMUM_VALUE, &ConfigRequest);
+}
+
+   /* Returns the entry of a data channel, LCID 0 returns a free entry. */
+static DataChannel_t *FindDataChannel(Word_t LCID)
+{
+	int i;
+
+	for(i = 0; i < MAX_DATA_CHANNELS; i++)
+	{
+		if(DataChannel[i].LCID == LCID)
+			return &DataChannel[i];
+	}
+
+	return NULL;
+}
+
 static void BTPSAPI L2CAP_Event_Callback(unsigned int BluetoothStackID, L2CA_Event_Data_t *L2CA_Event_Data, unsigned long CallbackParameter)
 {
 	int retval;
-	L2CA_Config_Request_t ConfigRequest;
+	Word_t InMTU;
+	Word_t OutMTU;
+	Word_t Result;
 	L2CA_Config_Response_t ConfigResponse;
+	DataChannel_t *Channel;
+	Byte_t Mode;
 
 	switch(L2CA_Event_Data->L2CA_Event_Type)
 	{
 	case etConnect_Indication:
 		LOG_INFO(("L2CAP: Received connection request\r\n"));
+
+		// the MTU we can accept depends on the memory the protocol layer
+		// gets for its buffers, refuse the connection if there is none
+		InMTU = connectionOpened(BluetoothStackID, L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->LCID,
+					L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->BD_ADDR, CallbackParameter == L2CAP_PSM_DATA);
+
 		// accept connection
 		retval = L2CA_Connect_Response(BluetoothStackID,
 				L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->BD_ADDR,
 				L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->Identifier,
 				L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->LCID,
-				L2CAP_CONNECT_RESPONSE_RESPONSE_SUCCESSFUL,
+				InMTU ? L2CAP_CONNECT_RESPONSE_RESPONSE_SUCCESSFUL : L2CAP_CONNECT_RESPONSE_RESPONSE_REFUSED_NO_RESOURCES,
 				0);
 
-		if(!retval)
+		if(!retval && InMTU)
 		{
 			/* Connect Response was issued successfully, so let's    */
-			/* clear the Config Request and fill the appropriate    */
-			/* fields.                                               */
-			memset(&ConfigRequest, 0, sizeof(L2CA_Config_Request_t));
+			/* send the Config Request.  The mode of a data channel  */
+			/* is remembered until the channel is disconnected.      */
+			Mode = L2CAP_MODE_INFO_MODE_BASIC;
 
-			/* Set the desired MTU.  This will tell the remote device*/
-			/* what the Maximum packet size that are capable if      */
-			/* receiving.                                            */
-			ConfigRequest.Option_Flags = L2CA_CONFIG_OPTION_FLAG_MTU;
-			ConfigRequest.InMTU        = (Word_t)50;
+			if(CallbackParameter == L2CAP_PSM_DATA && (Channel = FindDataChannel(0)) != NULL)
+			{
+				Mode           = L2CAP_DATA_MODE;
+				Channel->LCID  = L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->LCID;
+				Channel->InMTU = InMTU;
+				Channel->Mode  = Mode;
+			}
 
 			/* Send the Config Request to the Remote Device.         */
-			retval = L2CA_Config_Request(BluetoothStackID, L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->LCID, L2CAP_LINK_TIMEOUT_MAXIMUM_VALUE, &ConfigRequest);
+			retval = SendConfigRequest(BluetoothStackID, L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->LCID, InMTU, Mode);
 			if(retval)
 			{
 				LOG_ERROR(("     Config Request: Function Error %d.\r\n", retval));
 			}
-
-			connectionOpened(BluetoothStackID, L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->LCID);
 		}
-		else
+		else if(InMTU)
 		{
 			LOG_ERROR(("L2CA_Connect_Response failed: Error code %d", retval));
+
+			connectionClosed(L2CA_Event_Data->Event_Data.L2CA_Connect_Indication->LCID);
 		}
 		break;
 
@@ -642,7 +1336,10 @@ static void BTPSAPI L2CAP_Event_Callback(unsigned int BluetoothStackID, L2CA_Eve
 			LOG_ERROR(("L2CA_Disconnect_Indication failed: Error code %d", retval));
 		}
 
-		connectionClosed();
+		if((Channel = FindDataChannel(L2CA_Event_Data->Event_Data.L2CA_Disconnect_Indication->LCID)) != NULL)
+			Channel->LCID = 0;
+
+		connectionClosed(L2CA_Event_Data->Event_Data.L2CA_Disconnect_Indication->LCID);
 		break;
 
 	case etDisconnect_Confirmation:
@@ -655,15 +1352,50 @@ static void BTPSAPI L2CAP_Event_Callback(unsigned int BluetoothStackID, L2CA_Eve
 
 		memset(&ConfigResponse, 0, sizeof(L2CA_Config_Response_t));
 
-		if(L2CA_Event_Data->Event_Data.L2CA_Config_Indication->Option_Flags & L2CA_CONFIG_OPTION_FLAG_MTU)
+		OutMTU = L2CAP_DEFAULT_MTU;
+		Result = L2CAP_CONFIGURE_RESPONSE_RESULT_SUCCESS;
+
+		// both directions of a channel run in the same mode, the one we
+		// requested. A host asking for another mode is told ours, it
+		// either follows or rejects our request, then the next lower mode
+		// is tried
+		Channel = FindDataChannel(L2CA_Event_Data->Event_Data.L2CA_Config_Indication->LCID);
+		Mode    = (L2CA_Event_Data->Event_Data.L2CA_Config_Indication->Option_Flags & L2CA_CONFIG_OPTION_FLAG_MODE_INFO) ? L2CA_Event_Data->Event_Data.L2CA_Config_Indication->ModeInfo.Mode : L2CAP_MODE_INFO_MODE_BASIC;
+
+		if(Mode != (Channel ? Channel->Mode : L2CAP_MODE_INFO_MODE_BASIC))
+		{
+			LOG_INFO(("L2CAP: Mode %d is unacceptable\r\n", Mode));
+
+			Result                      = L2CAP_CONFIGURE_RESPONSE_RESULT_FAILURE_UNACCEPTABLE_PARAMETERS;
+			ConfigResponse.Option_Flags = L2CA_CONFIG_OPTION_FLAG_MODE_INFO;
+			if(Channel)
+				SetModeInfo(&ConfigResponse.ModeInfo, Channel->InMTU, Channel->Mode);
+			else
+				ConfigResponse.ModeInfo.Mode = L2CAP_MODE_INFO_MODE_BASIC;
+		}
+		else
 		{
-			ConfigResponse.Option_Flags |= L2CA_CONFIG_OPTION_FLAG_MTU;
-		    ConfigResponse.OutMTU = L2CA_Event_Data->Event_Data.L2CA_Config_Indication->OutMTU;
+			if(L2CA_Event_Data->Event_Data.L2CA_Config_Indication->Option_Flags & L2CA_CONFIG_OPTION_FLAG_MTU)
+			{
+				ConfigResponse.Option_Flags |= L2CA_CONFIG_OPTION_FLAG_MTU;
+				ConfigResponse.OutMTU = L2CA_Event_Data->Event_Data.L2CA_Config_Indication->OutMTU;
+
+				OutMTU = L2CA_Event_Data->Event_Data.L2CA_Config_Indication->OutMTU;
+			}
+
+			if(L2CA_Event_Data->Event_Data.L2CA_Config_Indication->Option_Flags & L2CA_CONFIG_OPTION_FLAG_MODE_INFO)
+			{
+				ConfigResponse.Option_Flags |= L2CA_CONFIG_OPTION_FLAG_MODE_INFO;
+				ConfigResponse.ModeInfo      = L2CA_Event_Data->Event_Data.L2CA_Config_Indication->ModeInfo;
+			}
+
+			// the tx buffer is sized from the MTU of the remote device
+			connectionConfigured(L2CA_Event_Data->Event_Data.L2CA_Config_Indication->LCID, OutMTU);
 		}
 
 		retval = L2CA_Config_Response(BluetoothStackID,
 				L2CA_Event_Data->Event_Data.L2CA_Config_Indication->LCID,
-				L2CAP_CONFIGURE_RESPONSE_RESULT_SUCCESS,
+				Result,
 				&ConfigResponse);
 		if(retval)
 		{
@@ -674,6 +1406,34 @@ static void BTPSAPI L2CAP_Event_Callback(unsigned int BluetoothStackID, L2CA_Eve
 
 	case etConfig_Confirmation:
 		LOG_INFO(("L2CAP: Config confirmation\r\n"));
+
+		Channel = FindDataChannel(L2CA_Event_Data->Event_Data.L2CA_Config_Confirmation->LCID);
+
+		// the remote device may have answered with a lower MTU
+		if(L2CA_Event_Data->Event_Data.L2CA_Config_Confirmation->Result == L2CAP_CONFIGURE_RESPONSE_RESULT_SUCCESS)
+		{
+			if(L2CA_Event_Data->Event_Data.L2CA_Config_Confirmation->Option_Flags & L2CA_CONFIG_OPTION_FLAG_MTU)
+				connectionConfirmed(L2CA_Event_Data->Event_Data.L2CA_Config_Confirmation->LCID, L2CA_Event_Data->Event_Data.L2CA_Config_Confirmation->InMTU);
+
+			if(Channel)
+				LOG_INFO(("L2CAP: Data channel runs in mode %d\r\n", Channel->Mode));
+		}
+		else if(Channel && Channel->Mode != L2CAP_MODE_INFO_MODE_BASIC)
+		{
+			// the host does not support the mode, try the next lower one
+			if(Channel->Mode == L2CAP_MODE_INFO_MODE_STREAMING)
+				Channel->Mode = L2CAP_MODE_INFO_MODE_ENHANCED_RETRANSMISSION;
+			else
+				Channel->Mode = L2CAP_MODE_INFO_MODE_BASIC;
+
+			LOG_INFO(("L2CAP: Mode rejected, trying mode %d\r\n", Channel->Mode));
+
+			retval = SendConfigRequest(BluetoothStackID, Channel->LCID, Channel->InMTU, Channel->Mode);
+			if(retval)
+			{
+				LOG_ERROR(("     Config Request: Function Error %d.\r\n", retval));
+			}
+		}
 		break;
 
 	case etData_Indication:
@@ -714,6 +1474,13 @@ static void BTPSAPI L2CAP_Event_Callback(unsigned int BluetoothStackID, L2CA_Eve
 		LOG_DEBUG(("etFixed_Channel_Data_Indication\r\n"));
 		break;
 
+	case etChannel_Buffer_Empty_Indication:
+		LOG_DEBUG(("L2CAP: Channel buffer empty\r\n"));
+
+		// frames which did not fit into the queue are sent again
+		protocol_tx_ready(L2CA_Event_Data->Event_Data.L2CA_Channel_Buffer_Empty_Indication->CID);
+		break;
+
 	default:
 		LOG_DEBUG(("L2CAP: Received some event which we do not handle\r\n"));
 		break;
@@ -736,8 +1503,9 @@ int InitializeApplication(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_I
 	/* semi-valid.                                                       */
 	if((HCI_DriverInformation) && (BTPS_Initialization))
 	{
-		/* Try to Open the stack and check if it was successful.          */
-		if(!OpenStack(HCI_DriverInformation, BTPS_Initialization))
+		/* Try to Open the stack and check if it was successful, then     */
+		/* bring the HCI UART up to speed.                                */
+		if((!OpenStack(HCI_DriverInformation, BTPS_Initialization)) && (!RampBaudRate(HCI_DriverInformation, BTPS_Initialization)))
 		{
 			/* The stack was opened successfully.  Now set some defaults.  */
 
@@ -758,13 +1526,28 @@ int InitializeApplication(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_I
 				{
 					SetLocalName(LOCAL_NAME);
 
+					// bonded hosts reconnect with their stored link key
+					SetPairable();
+
 
 
 					// NOW WE SHOULD INITIALIZE ALL L2CAP STUFF
-					ret_val = L2CA_Register_PSM(BluetoothStackID, 0x1001, L2CAP_Event_Callback, (unsigned long)NULL);
+					// the PSM is passed to the callback, so it knows which
+					// kind of channel an event belongs to
+					ret_val = L2CA_Register_PSM(BluetoothStackID, L2CAP_PSM_CONTROL, L2CAP_Event_Callback, (unsigned long)L2CAP_PSM_CONTROL);
+					if(ret_val < 0)
+						LOG_ERROR(("L2CA_Register_PSM failed: Error code %d\r\n", ret_val));
+
+					ret_val = L2CA_Register_PSM(BluetoothStackID, L2CAP_PSM_DATA, L2CAP_Event_Callback, (unsigned long)L2CAP_PSM_DATA);
 					if(ret_val < 0)
 						LOG_ERROR(("L2CA_Register_PSM failed: Error code %d\r\n", ret_val));
 
+#ifdef __SUPPORT_LOW_ENERGY__
+					// the bridge service is offered to LE clients as well
+					if(!RegisterGATTService())
+						AdvertiseLE();
+#endif
+
 					/* Return success to the caller.                   */
 					ret_val = (int)BluetoothStackID;
 				}
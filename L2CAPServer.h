@@ -20,4 +20,12 @@
    /* negative error code (of the form APPLICATION_ERROR_XXX).          */
 int InitializeApplication(HCI_DriverInformation_t *HCI_DriverInformation, BTPS_Initialization_t *BTPS_Initialization);
 
+#ifdef __SUPPORT_LOW_ENERGY__
+   /* Sends a frame of the protocol as notification of the GATT service  */
+   /* to the client of the given connection.  Returns zero on success,   */
+   /* BTPS_ERROR_INSUFFICIENT_RESOURCES while the stack has no room for  */
+   /* it or another negative error code.                                */
+int NotifyGATT(unsigned int ConnectionID, Word_t Length, Byte_t *Value);
+#endif
+
 #endif /* L2CAPSERVER_H_ */
@@ -18,8 +18,13 @@
 
 #include "I2C.h"
 #include "protocol.h"
+#include "sampler.h"
+#include "program.h"
 #include "L2CAPServer.h"
 
+   /* The following is the resolution in ms of the periodic sampling.    */
+#define SAMPLER_TICK                               (1)
+
    /* The following parameters are used when configuring HCILL Mode.    */
 #define HCILL_MODE_INACTIVITY_TIMEOUT              (500)
 #define HCILL_MODE_RETRANSMIT_TIMEOUT              (100)
@@ -60,8 +65,9 @@ static void IdleFunction(void *UserParameter)
    HCILL_State = HCILL_GetState();
 
    /* If the stack is Idle and we are in HCILL Sleep, then we may enter */
-   /* LPM3 mode (with Timer Interrupts disabled).                       */
-   if((BSC_QueryStackIdle(BluetoothStackID)) && (HCILL_State == hsSleep) && (!HCILL_Get_Power_Lock_Count()))
+   /* LPM3 mode (with Timer Interrupts disabled).  The scheduler is     */
+   /* stopped in LPM3, so not while there are subscriptions to sample.  */
+   if((BSC_QueryStackIdle(BluetoothStackID)) && (HCILL_State == hsSleep) && (!HCILL_Get_Power_Lock_Count()) && (!protocol_pending()) && (!I2C_pending()) && (!port2_events_pending()) && (!sampler_active()))
    {
       /* Enter MSP430 LPM3 with Timer Interrupts disabled (we will      */
       /* require an interrupt to wake us up from this state).           */
@@ -72,9 +78,9 @@ static void IdleFunction(void *UserParameter)
 }
 
 
-static void ButtonPollFunction(void *UserParameter)
+static void SamplerFunction(void *UserParameter)
 {
-	port2_poll();
+	sampler_poll();
 }
 
    /* The following function is the main user interface thread.  It     */
@@ -85,7 +91,8 @@ static void MainThread(void)
 	BTPS_Initialization_t   BTPS_Initialization;
 	HCI_DriverInformation_t HCI_DriverInformation;
 
-	/* Configure the UART Parameters.                                    */
+	/* Configure the UART Parameters.  The controller starts at 115200  */
+	/* baud, InitializeApplication() ramps it up to HCI_TARGET_BAUD_RATE.*/
 	HCI_DRIVER_SET_COMM_INFORMATION(&HCI_DriverInformation, 1, 115200, cpUART);
 	HCI_DriverInformation.DriverInformation.COMMDriverInformation.InitializationDelay = 100;
 
@@ -103,17 +110,24 @@ static void MainThread(void)
 		HCILL_Init();
 		HCILL_Configure(BluetoothStackID, HCILL_MODE_INACTIVITY_TIMEOUT, HCILL_MODE_RETRANSMIT_TIMEOUT, TRUE);
 
-		// add our polling function to the scheduler
-		// period = 50ms
-		if(BTPS_AddFunctionToScheduler(ButtonPollFunction, NULL, 50))
+		// add our sampling function to the scheduler
+		if(BTPS_AddFunctionToScheduler(SamplerFunction, NULL, SAMPLER_TICK))
 		{
 			/* Add the idle function (which determines if LPM3 may be      */
 			/* entered) to the scheduler.                                  */
 			if(BTPS_AddFunctionToScheduler(IdleFunction, NULL, HCILL_MODE_INACTIVITY_TIMEOUT))
 			{
-				/* Loop forever and execute the scheduler.                  */
+				/* Loop forever and execute the scheduler, the queued       */
+				/* requests, the finished i2c transfers, the running i2c    */
+				/* program and port events are processed in between.        */
 				while(1)
-				BTPS_ExecuteScheduler();
+				{
+					BTPS_ExecuteScheduler();
+					I2C_process();
+					protocol_process();
+					program_poll();
+					port2_flush();
+				}
 			}
 		}
 	}
@@ -131,6 +145,11 @@ int main(void)
 	HAL_ConfigureHardware();
 
 	// init hardware for I2C and push buttons
+	// free running timer for the timestamps of the port events and the
+	// timeouts of the i2c transactions, runs from ACLK so it keeps counting
+	// in LPM3
+	TB0CTL = TBSSEL_1 | ID_0 | MC_2 | TBCLR;
+
 	I2C_init();
 
 	P2DIR = 0;
@@ -0,0 +1,101 @@
+#include <msp430f5438a.h>
+#include "HRDWCFG.h"
+#include "flash.h"
+
+// The CPU is held while the flash controller erases (up to 32 ms) or writes,
+// interrupts are served only afterwards. So the controller is told to stop
+// sending on the HCI UART meanwhile (RTS), otherwise received bytes would be
+// lost. INFOA is locked by LOCKA and is not used.
+
+// The controller may still send some bytes after RTS has been raised. They
+// are received by the UART interrupt before interrupts are disabled: the RX
+// line has to be idle for FLASH_FLOW_IDLE byte times at the rate the UART
+// runs with (it is ramped up after boot).
+#define FLASH_FLOW_IDLE			2		// bytes
+#define FLASH_FLOW_LOOP_CYCLES	4		// less than one pass of the wait loop takes
+
+// CPU cycles one byte (start, 8 data and stop bits) takes on the HCI UART,
+// the UART is clocked from SMCLK like the CPU
+static unsigned long flash_byte_cycles()
+{
+	unsigned long bit = HWREG16(BT_UART_MODULE_BASE + MSP430_UART_BRW_OFFSET);
+
+	if(HWREG8(BT_UART_MODULE_BASE + MSP430_UART_MCTL_OFFSET) & MSP430_UART_MCTL_UCOS16_mask)
+		bit *= 16;
+
+	return 10 * bit;
+}
+
+static unsigned char flash_flow_off()
+{
+	unsigned char rts = HWREG8((BT_UART_FLOW_RTS_PIN_BASE) + MSP430F5438_GPIO_OUTPUT_OFFSET) & BT_UART_RTS_PIN;
+	unsigned long wait = FLASH_FLOW_IDLE * flash_byte_cycles() / FLASH_FLOW_LOOP_CYCLES;
+	unsigned long idle = 0;
+
+	BT_DISABLE_FLOW();
+
+	while(idle < wait)
+	{
+		if(HWREG8(BT_UART_MODULE_BASE + MSP430_UART_STAT_OFFSET) & MSP430_UART_STAT_BUSY_mask)
+			idle = 0;
+		else
+			idle++;
+	}
+
+	return rts;
+}
+
+static void flash_flow_restore(unsigned char rts)
+{
+	if(!rts)
+		BT_ENABLE_FLOW();
+}
+
+// erases the segment which contains the address
+void flash_erase(const void* segment)
+{
+	unsigned short state = __get_interrupt_state();
+	unsigned char rts;
+
+	rts = flash_flow_off();
+	__disable_interrupt();
+
+	while(FCTL3 & BUSY);
+	FCTL3 = FWKEY;
+	FCTL1 = FWKEY | ERASE;
+	*(volatile unsigned char *)segment = 0;		// dummy write starts the erase
+	while(FCTL3 & BUSY);
+	FCTL1 = FWKEY;
+	FCTL3 = FWKEY | LOCK;
+
+	flash_flow_restore(rts);
+	__set_interrupt_state(state);
+}
+
+// writes to erased flash, byte by byte
+void flash_write(const void* dst, const void* src, unsigned int len)
+{
+	volatile unsigned char* out = (volatile unsigned char *)dst;
+	const unsigned char* in = (const unsigned char *)src;
+	unsigned short state = __get_interrupt_state();
+	unsigned char rts;
+
+	rts = flash_flow_off();
+	__disable_interrupt();
+
+	while(FCTL3 & BUSY);
+	FCTL3 = FWKEY;
+	FCTL1 = FWKEY | WRT;
+
+	while(len--)
+	{
+		*out++ = *in++;
+		while(FCTL3 & BUSY);
+	}
+
+	FCTL1 = FWKEY;
+	FCTL3 = FWKEY | LOCK;
+
+	flash_flow_restore(rts);
+	__set_interrupt_state(state);
+}
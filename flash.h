@@ -0,0 +1,16 @@
+/*
+ * flash.h
+ *
+ * Erasing and writing the info flash segments (INFOA-INFOD), which keep
+ * data across resets.
+ */
+
+#ifndef FLASH_H_
+#define FLASH_H_
+
+#define FLASH_SEGMENT_SIZE	128
+
+void flash_erase(const void* segment);
+void flash_write(const void* dst, const void* src, unsigned int len);
+
+#endif /* FLASH_H_ */
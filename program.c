@@ -0,0 +1,337 @@
+#include <msp430x54x.h>
+#include <string.h>
+
+#include "Main.h"                /* Application Interface Abstraction.        */
+#include "SS1BTPS.h"             /* Main SS1 Bluetooth Stack Header.          */
+#include "L2CAPServer.h"         /* Application Header.                       */
+#include "BTPSKRNL.h"            /* BTPS Kernel Header.                       */
+
+#include "I2C.h"
+#include "protocol.h"
+#include "program.h"
+
+// The host uploads programs into one of PROGRAM_SLOTS slots and runs them
+// by their id. A program works on an accumulator (acc) and a loop counter,
+// the data of its reads is collected and returned in the answer.
+// request:  [command][arguments]
+// response: [command | error bit][data]
+#define PROGRAM_ERROR		0x80
+#define PROGRAM_LOAD		0x00	// [id][code], returns [id]
+#define PROGRAM_RUN			0x01	// [id][bus (optional)], returns [id][read data], on an error [id][pc of the failed op]
+#define PROGRAM_DELETE		0x02	// [id], returns [id]
+
+// ops, the operands follow the op code, jump targets are offsets into the code
+#define OP_END			0x00	// ends the program
+#define OP_WRITE		0x01	// [addr][len][data], writes the data
+#define OP_READ			0x02	// [addr][reg][len], reads the registers into the answer, acc = last byte
+#define OP_WRITE_ACC	0x03	// [addr][reg], writes acc to the register
+#define OP_AND			0x04	// [mask], acc &= mask
+#define OP_OR			0x05	// [bits], acc |= bits
+#define OP_JUMP_EQ		0x06	// [value][target], jumps if acc == value
+#define OP_JUMP_NE		0x07	// [value][target], jumps if acc != value
+#define OP_JUMP			0x08	// [target]
+#define OP_DELAY		0x09	// [ms (16 bit)], the radio is serviced meanwhile
+#define OP_COUNT		0x0A	// [count], sets the loop counter
+#define OP_LOOP			0x0B	// [target], decrements the loop counter and jumps while it is not 0
+#define OP_PROBE		0x0C	// [addr], acc = 1 if the device acknowledges a read (ACK polling), else 0
+
+// A failed transfer (except OP_PROBE), a bad op and running more than
+// PROGRAM_MAX_STEPS ops end the program with an error.
+#ifndef PROGRAM_SLOTS
+#define PROGRAM_SLOTS		4
+#endif
+#ifndef PROGRAM_SIZE
+#define PROGRAM_SIZE		64
+#endif
+#ifndef PROGRAM_MAX_STEPS
+#define PROGRAM_MAX_STEPS	1000
+#endif
+
+#define PROGRAM_HEADER_LEN	2
+
+unsigned char program_code[PROGRAM_SLOTS][PROGRAM_SIZE];
+unsigned char program_len[PROGRAM_SLOTS];		// 0: slot is empty
+
+// state of the running program, its answer is built in place in out. The
+// program does not wait for its transfers, it is continued at next by the
+// callback of the transfer.
+typedef struct
+{
+	unsigned char active;
+	unsigned char waiting;		// for the transfer
+	unsigned char id;
+	unsigned char bus;
+	unsigned char pc;
+	unsigned char acc;
+	unsigned char count;
+	unsigned int steps;
+	unsigned long due;			// end of a delay
+	unsigned char* out;
+	unsigned int outsize;
+	unsigned int outlen;
+	unsigned char next;
+	unsigned char data[2];		// written by OP_WRITE_ACC
+	unsigned char probe;
+	I2C_transfer_t transfer;
+} program_state_t;
+
+program_state_t program;
+
+
+// sends the answer, on an error it holds the pc of the op which failed
+void program_finish(int error)
+{
+	program.active = 0;
+
+	if(error)
+	{
+		program.out[0] |= PROGRAM_ERROR;
+		program.out[2] = program.pc;
+		program.outlen = 3;
+	}
+
+	protocol_respond(program.outlen);
+}
+
+void program_done(I2C_transfer_t* transfer);
+
+// submits the transfer of the op at pc
+void program_submit(unsigned char addr, unsigned char* txdata, unsigned int txlen, unsigned char* rxdata, unsigned int rxlen, unsigned int next)
+{
+	program.transfer.bus = program.bus;
+	program.transfer.addr = addr;
+	program.transfer.flags = I2C_FIRST | I2C_LAST;
+	program.transfer.txdata = txdata;
+	program.transfer.txlen = txlen;
+	program.transfer.rxdata = rxdata;
+	program.transfer.rxlen = rxlen;
+	program.transfer.callback = program_done;
+
+	program.next = next;
+	program.waiting = 1;
+	I2C_submit(&program.transfer);
+}
+
+// runs the program until it ends or waits for a delay or a transfer
+void program_run()
+{
+	unsigned char* code = program_code[program.id];
+	unsigned char len = program_len[program.id];
+
+	while(program.active)
+	{
+		unsigned char* op = &code[program.pc];
+		unsigned int oplen;
+		unsigned int next;
+
+		if(program.pc >= len || ++program.steps > PROGRAM_MAX_STEPS)
+		{
+			program_finish(1);
+			return;
+		}
+
+		// length of the op, the operands have to be in the code
+		switch(op[0])
+		{
+		case OP_END:		oplen = 1; break;
+		case OP_WRITE:		oplen = (program.pc + 2 < len) ? 3 + op[2] : 3; break;
+		case OP_READ:		oplen = 4; break;
+		case OP_WRITE_ACC:
+		case OP_JUMP_EQ:
+		case OP_JUMP_NE:
+		case OP_DELAY:		oplen = 3; break;
+		default:			oplen = 2; break;
+		}
+
+		if(program.pc + oplen > len)
+		{
+			program_finish(1);
+			return;
+		}
+
+		next = program.pc + oplen;
+
+		switch(op[0])
+		{
+		case OP_END:
+			program_finish(0);
+			return;
+
+		case OP_WRITE:
+			if(op[2] == 0)
+			{
+				program_finish(1);
+				return;
+			}
+			program_submit(op[1] & 0x7f, &op[3], op[2], NULL, 0, next);
+			return;
+
+		case OP_READ:
+			// the data is read directly into the answer
+			if(op[3] == 0 || program.outlen + op[3] > program.outsize)
+			{
+				program_finish(1);
+				return;
+			}
+			program_submit(op[1] & 0x7f, &op[2], 1, &program.out[program.outlen], op[3], next);
+			return;
+
+		case OP_WRITE_ACC:
+			program.data[0] = op[2];
+			program.data[1] = program.acc;
+			program_submit(op[1] & 0x7f, program.data, 2, NULL, 0, next);
+			return;
+
+		case OP_AND:
+			program.acc &= op[1];
+			break;
+
+		case OP_OR:
+			program.acc |= op[1];
+			break;
+
+		case OP_JUMP_EQ:
+			if(program.acc == op[1])
+				next = op[2];
+			break;
+
+		case OP_JUMP_NE:
+			if(program.acc != op[1])
+				next = op[2];
+			break;
+
+		case OP_JUMP:
+			next = op[1];
+			break;
+
+		case OP_DELAY:
+			program.pc = next;
+			program.due = BTPS_GetTickCount() + ((op[1] << 8) | op[2]);
+			return;
+
+		case OP_COUNT:
+			program.count = op[1];
+			break;
+
+		case OP_LOOP:
+			if(program.count && --program.count)
+				next = op[1];
+			break;
+
+		case OP_PROBE:
+			program_submit(op[1] & 0x7f, NULL, 0, &program.probe, 1, next);
+			return;
+
+		default:
+			program_finish(1);
+			return;
+		}
+
+		program.pc = next;
+	}
+}
+
+// finishes the op at pc and continues the program
+void program_done(I2C_transfer_t* transfer)
+{
+	unsigned char* op = &program_code[program.id][program.pc];
+
+	program.waiting = 0;
+
+	// the connection has been closed in the meantime
+	if(!program.active)
+		return;
+
+	if(op[0] == OP_PROBE)
+		program.acc = (transfer->status == I2C_OK);
+	else if(transfer->status != I2C_OK)
+	{
+		program_finish(1);
+		return;
+	}
+	else if(op[0] == OP_READ)
+	{
+		program.outlen += op[3];
+		program.acc = program.out[program.outlen - 1];
+	}
+
+	program.pc = program.next;
+	program_run();
+}
+
+// returns the length of the answer, 0 if the program is running and
+// answers later on by itself
+int program_packet(unsigned char payload[], int size, unsigned char out[], unsigned int outsize)
+{
+	int len = 0;
+
+	if(size < 2 || payload[1] >= PROGRAM_SLOTS)
+	{
+		out[0] = payload[0] | PROGRAM_ERROR;
+		return 1;
+	}
+
+	out[0] = payload[0];
+	out[1] = payload[1];
+
+	switch (payload[0])
+	{
+	case PROGRAM_LOAD:
+		if(size > 2 && size - 2 <= PROGRAM_SIZE)
+		{
+			memcpy(program_code[payload[1]], &payload[2], size - 2);
+			program_len[payload[1]] = size - 2;
+			len = 2;
+		}
+		break;
+
+	case PROGRAM_RUN:
+		if(program_len[payload[1]] == 0 || (size > 2 && !I2C_bus_enabled(payload[2])))
+			break;
+
+		program.id = payload[1];
+		program.bus = size > 2 ? payload[2] : I2C_DEFAULT_BUS;
+		program.pc = 0;
+		program.acc = 0;
+		program.count = 0;
+		program.steps = 0;
+		program.due = BTPS_GetTickCount();
+		program.out = out;
+		program.outsize = outsize;
+		program.outlen = PROGRAM_HEADER_LEN;
+		program.waiting = 0;
+		program.active = 1;
+
+		program_run();
+		return 0;
+
+	case PROGRAM_DELETE:
+		program_len[payload[1]] = 0;
+		len = 2;
+		break;
+
+	default:
+		break;
+	}
+
+	if(len == 0)
+	{
+		out[0] |= PROGRAM_ERROR;
+		len = 1;
+	}
+
+	return len;
+}
+
+// called from the main loop, continues a program after its delay
+void program_poll()
+{
+	if(program.active && !program.waiting && (long)(BTPS_GetTickCount() - program.due) >= 0)
+		program_run();
+}
+
+// the connection has been closed, the answer can not be sent anymore
+void program_abort()
+{
+	program.active = 0;
+}
@@ -0,0 +1,15 @@
+/*
+ * program.h
+ *
+ * Small i2c programs which are uploaded by the host and run by the device,
+ * so a sequence of dependent transfers completes in a single request.
+ */
+
+#ifndef PROGRAM_H_
+#define PROGRAM_H_
+
+int program_packet(unsigned char payload[], int size, unsigned char out[], unsigned int outsize);
+void program_poll();
+void program_abort();
+
+#endif /* PROGRAM_H_ */
@@ -8,6 +8,8 @@
 #include "BTPSKRNL.h"            /* BTPS Kernel Header.                       */
 
 #include "I2C.h"
+#include "sampler.h"
+#include "program.h"
 
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
@@ -16,52 +18,223 @@ typedef unsigned short uint16_t;
 int type;
 int len;
 int seq;
-int ownseq = 0;
-Word_t g_LCID = 0;
 unsigned int g_BluetoothStackID;
 
-// variables used temporary but initialized only once
-unsigned char packet[50];
+// The frame buffers are sized from the MTUs negotiated with the host and
+// allocated from the BTPS heap when a connection is opened/configured.
+// PROTOCOL_MAX_MTU limits them to what the RAM budget allows, the heap
+// (BTPS_MEMORY_BUFFER_SIZE) has to leave room for them, see the budget below.
+#ifndef PROTOCOL_MAX_MTU
+#define PROTOCOL_MAX_MTU	256
+#endif
 
-int l2cap_send(unsigned int BluetoothStackID, Word_t LCID, uint8_t *data, uint16_t len);
+// smallest MTU every L2CAP implementation has to support
+#define FRAME_MIN			48
 
+// max number of requests the host may have outstanding
+#ifndef PROTOCOL_WINDOW
+#define PROTOCOL_WINDOW		4
+#endif
 
-void send_bt_request(unsigned char payload[], int paylen)
+// Several hosts can be connected at once. Every L2CAP channel has its own
+// context with its sequence counter, request queue and tx buffer, the
+// requests of the channels are handled in turns.
+#ifndef PROTOCOL_MAX_CONNECTIONS
+#define PROTOCOL_MAX_CONNECTIONS	2
+#endif
+
+// The frames are queued by the stack, up to PROTOCOL_TX_QUEUE per channel.
+// A frame which does not fit into the queue anymore stays in the tx buffer
+// and is sent again when the stack reports that the queue has drained.
+// Meanwhile the buffer is busy: no requests of the channel are handled and
+// protocol_tx_payload() returns NULL, so the producers hold back their data.
+#ifndef PROTOCOL_TX_QUEUE
+#define PROTOCOL_TX_QUEUE			4
+#endif
+#define PROTOCOL_TX_LOW				1
+
+// A host may open a channel on the data PSM besides its control channel.
+// Block reads and stream samples of the host are sent there, with a larger
+// MTU and a deeper queue in the stack, so the answers on the control channel
+// never wait behind them. Requests of control channels are handled before
+// those of data channels, port events only go to control channels.
+#ifndef PROTOCOL_DATA_MAX_MTU
+#define PROTOCOL_DATA_MAX_MTU		672
+#endif
+#ifndef PROTOCOL_DATA_TX_QUEUE
+#define PROTOCOL_DATA_TX_QUEUE		2
+#endif
+
+// Heap budget: the buffers above and the frames the stack has queued all
+// come from the BTPS heap. The worst case is a control and a data channel:
+//   the stack itself                                      3200
+//   request queues    2 * PROTOCOL_WINDOW * 256           2048
+//   control channel   (1 + PROTOCOL_TX_QUEUE) * 256       1280
+//   data channel      (1 + PROTOCOL_DATA_TX_QUEUE) * 672  2016
+//                                                         ----
+//                                                         8544
+// plus some bytes of overhead per frame in the stack. Two control channels
+// need less. A deeper data queue or larger MTUs need a larger heap: the total
+// must stay at or below BTPS_MEMORY_BUFFER_SIZE (8704 in the Debug
+// configurations), which is checked below.
+#define PROTOCOL_HEAP_NEED	(3200L + 2L * PROTOCOL_WINDOW * PROTOCOL_MAX_MTU \
+							+ (1L + PROTOCOL_TX_QUEUE) * PROTOCOL_MAX_MTU \
+							+ (1L + PROTOCOL_DATA_TX_QUEUE) * PROTOCOL_DATA_MAX_MTU)
+
+#if defined(BTPS_MEMORY_BUFFER_SIZE) && BTPS_MEMORY_BUFFER_SIZE < PROTOCOL_HEAP_NEED
+#error "BTPS_MEMORY_BUFFER_SIZE is too small for the frame buffers and tx queues"
+#endif
+
+typedef struct
 {
-	//generate full package
-	packet[0] = (type<<5) | (paylen+3);
-	packet[1]=  ownseq;
-	packet[2] = 0xff;
-	memcpy(&packet[3], payload, paylen);
-	//send packet
+	Word_t LCID;				// 0: unused, the ConnectionID for GATT
+	BD_ADDR_t BD_ADDR;			// the host
+	unsigned char data;			// channel of the data PSM
+	unsigned char gatt;			// GATT connection over LE
+	Word_t gatt_config;			// client configuration of the response characteristic
+	unsigned char closed;		// disconnected, cleaned up by protocol_process()
+	int ownseq;
+
+	unsigned char* tx_frame;
+	unsigned int tx_mtu;
+	unsigned int rx_mtu;
+
+	unsigned int tx_pending;	// length of the frame waiting in tx_frame, 0: none
+	unsigned char tx_retry;		// the queue of the stack has drained
+	unsigned int tx_deferred;	// frames which had to wait
+	unsigned int tx_dropped;	// frames the stack refused
+	unsigned int tx_queued;		// frames in the queue of the stack, as far as known
+	unsigned char tx_held;		// a sample is read into tx_frame, see protocol_tx_hold()
+
+	// queue of the received requests, every slot holds a frame of up to
+	// rx_slot_size bytes
+	unsigned char* rx_queue;
+	unsigned int rx_slot_size;
+	unsigned int rx_queue_len[PROTOCOL_WINDOW];
+	int rx_queue_head;
+	int rx_queue_count;
+} connection_t;
+
+connection_t connections[PROTOCOL_MAX_CONNECTIONS];
+
+// the connection whose request is handled
+connection_t* request_conn = &connections[0];
+
+// the connection its answer is sent to, the data channel of the host for
+// block reads
+connection_t* reply_conn = &connections[0];
+
+connection_t* connection_data(connection_t* conn);
+int connection_busy(connection_t* conn);
+Word_t connection_open(connection_t* conn, Word_t id, BD_ADDR_t BD_ADDR, unsigned char data, unsigned char gatt);
+void connection_tx_mtu(connection_t* conn, Word_t OutMTU);
+void connection_close(connection_t* conn);
+void connection_cleanup(connection_t* conn);
+
+// Outgoing packets are built in place: the handlers (and the i2c driver)
+// write the payload directly to tx_payload, the header is filled in afterwards
+// by send_bt_request()/send_bt_response(). So no copies are needed.
+// tx_payload is the buffer of the connection the answer is sent to.
+#define TX_HEADER_LEN	3
+#define TX_PAYLOAD_MAX	(reply_conn->tx_mtu - TX_HEADER_LEN)
+#define tx_payload		(&reply_conn->tx_frame[TX_HEADER_LEN])
+
+// the length field of the header only has 5 bits, longer packets carry 0 there
+// and the receiver has to use the length of the L2CAP packet instead
+#define HEADER_LEN(n)	((n) > 0x1f ? 0 : (n))
+
+int l2cap_send(unsigned int BluetoothStackID, Word_t LCID, uint8_t *data, uint16_t len, unsigned int queue);
+
+// the number of frames the stack queues for the connection
+unsigned int connection_tx_queue(connection_t* conn)
+{
+	return conn->data ? PROTOCOL_DATA_TX_QUEUE : PROTOCOL_TX_QUEUE;
+}
+
+// hands the frame in the tx buffer to the stack, keeps it if the queue is full.
+// The stack does not tell how many frames it holds, tx_queued counts those
+// handed over since it last reported that its queue has drained
+void send_frame(connection_t* conn, unsigned int len)
+{
+	int retval;
+
+	// the connection is gone, the frame is lost
+	if(conn->closed)
+	{
+		conn->tx_pending = 0;
+		return;
+	}
+
+#ifdef __SUPPORT_LOW_ENERGY__
+	if(conn->gatt)
+		retval = NotifyGATT(conn->LCID, len, conn->tx_frame);
+	else
+#endif
+		retval = l2cap_send(g_BluetoothStackID, conn->LCID, conn->tx_frame, len, connection_tx_queue(conn));
+
+	if(retval == BTPS_ERROR_INSUFFICIENT_RESOURCES)
+	{
+		if(!conn->tx_pending)
+			conn->tx_deferred++;
+		conn->tx_pending = len;
+		conn->tx_queued = connection_tx_queue(conn);
+	}
+	else
+	{
+		if(retval)
+			conn->tx_dropped++;
+		else if(conn->tx_queued < connection_tx_queue(conn))
+			conn->tx_queued++;
+		conn->tx_pending = 0;
+	}
+}
+
+
+// sends the payload in the tx buffer of the channel (protocol_tx_payload())
+// as unsolicited packet of the given type
+void send_bt_request(int channel, int reqtype, int paylen)
+{
+	connection_t* conn = &connections[channel];
+
+	//generate header
+	conn->tx_frame[0] = (reqtype<<5) | HEADER_LEN(paylen+3);
+	conn->tx_frame[1]=  conn->ownseq;
+	conn->tx_frame[2] = 0xff;
 
 	// actually send the packet
-	l2cap_send(g_BluetoothStackID, g_LCID, packet, paylen+3);
+	send_frame(conn, paylen+3);
 
 	//update ownseq
-	ownseq = (ownseq + 1) % 0xFF;
+	conn->ownseq = (conn->ownseq + 1) % 0xFF;
 }
 
-void send_bt_response(unsigned char payload[], int paylen)
+// sends the payload in the tx buffer of the connection as response to the
+// request with the given type and seq
+void send_bt_reply(connection_t* conn, int reptype, int repseq, int paylen)
 {
-	//generate full package
-	packet[0] = (type<<5) | (paylen+3);
-	packet[1]=  ownseq;
-	packet[2] = seq;
-	memcpy(&packet[3], payload, paylen);
-	//send packet
+	//generate header
+	conn->tx_frame[0] = (reptype<<5) | HEADER_LEN(paylen+3);
+	conn->tx_frame[1]=  conn->ownseq;
+	conn->tx_frame[2] = repseq;
 
 	// actually send the packet
-	l2cap_send(g_BluetoothStackID, g_LCID, packet, paylen+3);
+	send_frame(conn, paylen+3);
 
 	//update ownseq
-	ownseq = (ownseq + 1) % 0xFF;
+	conn->ownseq = (conn->ownseq + 1) % 0xFF;
+}
+
+// sends the payload in tx_payload as response to the current request
+void send_bt_response(int paylen)
+{
+	send_bt_reply(reply_conn, type, seq, paylen);
 }
 
-void gpio_err(unsigned char payload[])	//error occured: not consistent
+int gpio_err(unsigned char payload[], unsigned char out[])	//error occured: not consistent
 {
-	payload[0] = payload [0] | 64; //ser error bit
-	send_bt_response(payload, 2);
+	out[0] = payload[0] | 64; //ser error bit
+	out[1] = payload[1];
+	return 2;
 }
 
 
@@ -74,167 +247,1441 @@ void get_header(unsigned char packet[])
 		header_err(packet);*/
 }
 
-void i2c_write(unsigned char addr, unsigned char command[], int size)		//to correct
+// the i2c and gpio handlers write their answer into out and return its length,
+// so they can be used for single packets as well as for batched packets
+// i2c_prepare() generates the answer and sets up the i2c transfer which
+// writes the data and reads directly into the answer, i2c_finish() fills in
+// the status once the transfer has finished
+// A read writes the data (usually the register address) and switches to
+// reading with a repeated start condition. Devices which need a stop
+// condition in between are read with I2C_READ_SPLIT set in the length byte.
+// A payload without the address and length bytes is rejected with -1.
+#define I2C_READ_SPLIT	0x80
+
+int i2c_prepare(unsigned char bus, unsigned char payload[], int size, unsigned char out[], I2C_transfer_t* transfer)
+{
+	int rw;
+	unsigned char rxlen;
+	int txlen;
+
+	if(size < 2)
+		return -1;
+
+	rw = payload[0] >> 7;
+	rxlen = rw ? payload[1] & 31 : 0;
+	txlen = size-2;
+
+	//generate answer, the received data is placed directly behind it
+	out[0] = payload[0];
+	out[1] = rxlen;
+	memcpy(&out[2], &payload[2], txlen);
+
+	transfer->bus = bus;
+	transfer->addr = payload[0] & 0x7f;
+	transfer->flags = I2C_FIRST | I2C_LAST;
+	if(rw && (payload[1] & I2C_READ_SPLIT))
+		transfer->flags |= I2C_SPLIT;
+	transfer->txdata = &payload[2];
+	transfer->txlen = txlen;
+	transfer->rxdata = &out[2+txlen];
+	transfer->rxlen = rxlen;
+	transfer->callback = NULL;
+
+	return 2 + txlen + rxlen;
+}
+
+void i2c_finish(unsigned char out[], I2C_transfer_t* transfer)
 {
-	unsigned char package[256];
-	int txlen = size-1;
+	if(transfer->status != I2C_OK)		//set error bit if the transfer failed
+		out[1] |= 0x40;
+	if(transfer->status == I2C_TIMEOUT)	//the bus hung and has been recovered
+		out[1] |= 0x20;
+}
 
-	if(I2C_write(addr, &command[1], txlen))	//if return true, an error occured
-		package[1] = 0x40;
+// length of the answer i2c_prepare() will generate for this request
+int i2c_response_len(unsigned char payload[], int size)
+{
+	if(payload[0] >> 7)
+		return 2 + (payload[1] & 31) + (size-2);
 	else
-		package[1] = 0;
+		return 2 + (size-2);
+}
 
-	//generate rest of answer
-	package[0] = addr;
-	memcpy(&package[2], &command[1], txlen);
-	//send answer
-	send_bt_response(package, txlen+2);
+int gpio_request(unsigned char payload[], unsigned char out[])
+{
+	int pingroup = payload[0] & 31;
+	if((payload[0] & 128) == 0 || pingroup != 2 ) //throw an error if not a request or pingroup not 2 as only one supported
+		return gpio_err(payload, out);
+
+	out[0] = (1 << 7) | 2;
+	out[1] = ~P2IN; //value has to be inverted as we detect low
+	return 2;
 }
 
-void i2c_read(unsigned char addr, unsigned char payload[], int size)
+// A request whose i2c transfer runs asynchronously keeps request_active set
+// until its answer has been sent by the callback of the transfer. No other
+// request is processed meanwhile and the tx buffer of its connection must not
+// be used by anyone else.
+int request_active = 0;
+int request_resplen;
+I2C_transfer_t request_transfer;
+
+void protocol_complete();
+void protocol_respond(int paylen);
+
+// A batch packet carries a list of sub-operations, each one prefixed by a
+// sub-header byte (type<<5 | length of the sub-payload). The sub-payloads
+// have the same format as the payload of a single i2c, gpio or bus i2c packet.
+// The answers are returned in one response, each prefixed by a sub-header of
+// the same format. Sub-operations whose answer would not fit into the
+// response are not executed anymore, the host detects this by the number of
+// answers.
+// Up to BATCH_PARALLEL i2c sub-operations are submitted at once, so the ones
+// on different buses run in parallel. The sub-operations on one bus run in
+// their order, a gpio sub-operation waits for all i2c sub-operations before it.
+// The batch does not wait for the transfers: it stops at the first
+// sub-operation which has to wait and is continued by the callback of the
+// last transfer, which sends the answer once all sub-operations are done.
+#ifndef BATCH_PARALLEL
+#define BATCH_PARALLEL	4
+#endif
+
+I2C_transfer_t batch_transfers[BATCH_PARALLEL];
+unsigned char* batch_answers[BATCH_PARALLEL];
+int batch_submitted;
+int batch_finished;
+
+// state of the running batch
+unsigned char* batch_payload;
+int batch_size;
+int batch_pos;
+unsigned char* batch_out;
+int batch_outsize;
+int batch_outlen;
+
+int batch_run();
+
+// fills in the status of the finished i2c sub-operations
+void batch_flush()
 {
-	unsigned char package[32];
-	unsigned char rxdata[16];
-	unsigned char rxlen = payload[0] & 31;
-	int txlen = size-1;
-	if(!I2C_write(addr, &payload[1], txlen))	//if sendi2c does not fail go on with get
+	int i;
+
+	for(i = 0; i < batch_submitted; i++)
+		i2c_finish(batch_answers[i], &batch_transfers[i]);
+
+	batch_submitted = 0;
+	batch_finished = 0;
+}
+
+void batch_done(I2C_transfer_t* transfer)
+{
+	// the connection has been closed in the meantime
+	if(!request_active)
+		return;
+
+	if(++batch_finished < batch_submitted)
+		return;
+
+	batch_flush();
+	if(!batch_run())
+		protocol_respond(batch_outlen);
+}
+
+// prepares the answer of an i2c sub-operation and submits its transfer
+int batch_i2c(unsigned char bus, unsigned char payload[], int size, unsigned char out[])
+{
+	I2C_transfer_t* transfer = &batch_transfers[batch_submitted];
+	int resplen;
+
+	resplen = i2c_prepare(bus, payload, size, out, transfer);
+	transfer->callback = batch_done;
+	batch_answers[batch_submitted] = out;
+	batch_submitted++;
+	I2C_submit(transfer);
+
+	return resplen;
+}
+
+// runs the sub-operations from batch_pos on, returns 1 if it has to wait for
+// the submitted transfers
+int batch_run()
+{
+	unsigned char* payload = batch_payload;
+	unsigned char* out = batch_out;
+
+	while(batch_pos < batch_size)
+	{
+		int subtype = payload[batch_pos] >> 5;
+		int sublen = payload[batch_pos] & 0x1f;
+		unsigned char* subpayload = &payload[batch_pos+1];
+		int resplen;
+
+		if(batch_pos + 1 + sublen > batch_size)	//truncated sub-operation
+			break;
+
+		if(subtype == 0)	//i2c
+		{
+			// every i2c sub-operation carries [rw<<7 | addr][len]
+			if(sublen < 2)
+				break;
+			if(i2c_response_len(subpayload, sublen) > 0x1f || batch_outlen + 1 + i2c_response_len(subpayload, sublen) > batch_outsize)
+				break;
+			if(batch_submitted == BATCH_PARALLEL)
+				return 1;
+			resplen = batch_i2c(I2C_DEFAULT_BUS, subpayload, sublen, &out[batch_outlen+1]);
+		}
+		else if(subtype == 1)	//gpio
+		{
+			if(sublen < 2 || batch_outlen + 1 + 2 > batch_outsize)
+				break;
+			if(batch_submitted)
+				return 1;
+			resplen = gpio_request(subpayload, &out[batch_outlen+1]);
+		}
+		else if(subtype == 4)	//i2c on a given bus
+		{
+			if(sublen < 3)
+				break;
+			if(1 + i2c_response_len(&subpayload[1], sublen-1) > 0x1f || batch_outlen + 2 + i2c_response_len(&subpayload[1], sublen-1) > batch_outsize)
+				break;
+			if(batch_submitted == BATCH_PARALLEL)
+				return 1;
+			out[batch_outlen+1] = subpayload[0];
+			resplen = 1 + batch_i2c(subpayload[0], &subpayload[1], sublen-1, &out[batch_outlen+2]);
+		}
+		else	//unknown sub-operation, stop here
+			break;
+
+		out[batch_outlen] = (subtype << 5) | resplen;
+		batch_outlen += 1 + resplen;
+		batch_pos += 1 + sublen;
+	}
+
+	return batch_submitted != 0;
+}
+
+// returns 1 if the answer is sent later on by the callback of the transfers,
+// otherwise it has been written to out and its length is in batch_outlen
+int batch_packet(unsigned char payload[], int size, unsigned char out[], int outsize)
+{
+	batch_payload = payload;
+	batch_size = size;
+	batch_pos = 0;
+	batch_out = out;
+	batch_outsize = outsize;
+	batch_outlen = 0;
+	batch_submitted = 0;
+	batch_finished = 0;
+
+	return batch_run();
+}
+
+void i2c_done(I2C_transfer_t* transfer)
+{
+	// the connection has been closed in the meantime
+	if(!request_active)
+		return;
+
+	// the answer of a bus i2c request starts with the bus
+	if(type == 4)
+		i2c_finish(&tx_payload[1], transfer);
+	else
+		i2c_finish(tx_payload, transfer);
+	send_bt_response(request_resplen);
+	protocol_complete();
+}
+
+// Block transfers move up to 64k bytes in one i2c transaction. The data is
+// split up into several packets which are streamed directly from/into the
+// i2c driver, the bus is held between two packets.
+// request:  [rw<<7 | addr][flags][len or offset (16 bit)][data or register]
+// response: [rw<<7 | addr][status][offset (16 bit)][data]
+#define BLOCK_FLAG_CONTINUE		0x01	// request continues a block write, the 16 bit field is the offset
+#define BLOCK_STATUS_ERROR		0x40
+#define BLOCK_STATUS_LAST		0x20	// the transfer is complete
+#define BLOCK_STATUS_TIMEOUT	0x10	// the bus hung and has been recovered
+#define BLOCK_HEADER_LEN		4
+
+// state of a block write spanning several packets
+int block_active = 0;
+connection_t* block_conn;
+unsigned char block_addr;
+unsigned int block_total;
+unsigned int block_done;
+
+// A block read runs as a job of its own, its chunks are read one after
+// another by the callback of its transfer and sent to block_read_conn (the
+// data channel of the host, if it has one). Its request is complete once the
+// register address has been written, so other requests are handled while
+// the chunks are streamed. Only those which need the bus of the read (it is
+// held between two chunks) or its tx buffer have to wait.
+int block_read_active = 0;
+int block_read_request;			// the request is still open
+connection_t* block_read_conn;
+unsigned char block_read_seq;
+I2C_transfer_t block_read_transfer;
+unsigned int block_read_total;
+unsigned int block_read_done;
+int block_read_closed = 0;		// the connection is gone, the running chunk ends the read
+
+void block_header(unsigned char out[], unsigned char addr, unsigned char status, unsigned int offset)
+{
+	out[0] = addr;
+	out[1] = status;
+	out[2] = offset >> 8;
+	out[3] = offset & 0xff;
+}
+
+// releases the bus if a block transfer has left it open
+void block_abort()
+{
+	I2C_stop(I2C_DEFAULT_BUS);
+	block_active = 0;
+}
+
+// sets up the transfer of the next chunk of a block read
+void block_read_next(I2C_transfer_t* transfer)
+{
+	unsigned int chunk = block_read_total - block_read_done;
+	unsigned int chunkmax = block_read_conn->tx_mtu - TX_HEADER_LEN - BLOCK_HEADER_LEN;
+
+	if(chunk > chunkmax)
 	{
-		if(I2C_read(addr, rxdata, rxlen))		//set error bit if geti2c fails
-			package[1] = rxlen | 0x40;
-		else
-			package[1] = rxlen;
+		chunk = chunkmax;
+
+		// the stop condition is generated while the second last byte is
+		// read, so the last part must not consist of a single byte
+		if(block_read_total - block_read_done - chunk == 1)
+			chunk--;
 	}
 	else
-		package[1] = rxlen | 0x40;		//sendi2c failed
-	//generate answer
-	size = 2 + rxlen + txlen;
+		transfer->flags |= I2C_LAST;
 
-	package[0] =  (addr | 128);
-	memcpy(&package[2], &payload[1],txlen);
-	memcpy(&package[2+txlen], rxdata, rxlen);
-	//send answer
-	send_bt_response(package, size);
+	transfer->rxdata = &block_read_conn->tx_frame[TX_HEADER_LEN + BLOCK_HEADER_LEN];
+	transfer->rxlen = chunk;
 }
 
-void i2c_packet(unsigned char payload[], int size)
+// a chunk has been read but could not be sent yet
+int block_read_stalled = 0;
+
+void block_read_continue(I2C_transfer_t* transfer)
 {
-	int rw = payload[0] >> 7;
-	unsigned char addr = payload[0] & 0x7f;
-	if (rw)
-		i2c_read(addr, &payload[1], size-1);
+	transfer->flags = 0;
+	transfer->txlen = 0;
+	block_read_next(transfer);
+	I2C_submit(transfer);
+}
+
+// releases the bus and the request of a block read whose connection is gone
+void block_read_end()
+{
+	block_read_active = 0;
+	block_read_closed = 0;
+	I2C_stop(I2C_DEFAULT_BUS);
+
+	if(block_read_request)
+	{
+		block_read_request = 0;
+		protocol_complete();
+	}
+}
+
+void block_read_chunk(I2C_transfer_t* transfer)
+{
+	unsigned char* out = &block_read_conn->tx_frame[TX_HEADER_LEN];
+	unsigned char addr = transfer->addr | 128;
+	unsigned char status = 0;
+	unsigned int paylen = BLOCK_HEADER_LEN;
+
+	if(!block_read_active)
+		return;
+
+	if(block_read_closed)
+	{
+		block_read_end();
+		return;
+	}
+
+	if(transfer->status != I2C_OK)
+	{
+		// a NACK already generated the stop condition, a timeout recovered the bus
+		status = BLOCK_STATUS_ERROR | BLOCK_STATUS_LAST;
+		if(transfer->status == I2C_TIMEOUT)
+			status |= BLOCK_STATUS_TIMEOUT;
+	}
 	else
-		i2c_write(addr, &payload[1], size-1);
+	{
+		if(transfer->flags & I2C_LAST)
+			status = BLOCK_STATUS_LAST;
+		paylen += transfer->rxlen;
+	}
+
+	block_header(out, addr, status, block_read_done);
+	send_bt_reply(block_read_conn, 3, block_read_seq, paylen);
+
+	block_read_done += paylen - BLOCK_HEADER_LEN;
+
+	// the register address has been written, the slot of the request is not
+	// needed anymore
+	if(block_read_request)
+	{
+		block_read_request = 0;
+		protocol_complete();
+	}
+
+	if(status & BLOCK_STATUS_LAST)
+	{
+		block_read_active = 0;
+		return;
+	}
+
+	// the next chunk is read into the frame, which may still wait for the
+	// stack. The bus stays held meanwhile.
+	if(block_read_conn->tx_pending)
+	{
+		block_read_stalled = 1;
+		return;
+	}
+
+	block_read_continue(transfer);
 }
 
-void gpio_send(int resp, int port_stat)
+// ends a block read whose connection is gone. A chunk which is still read
+// into the tx buffer is left to its callback, which ends the read then.
+// Returns 1 once the tx buffer of the read is not used anymore.
+int block_read_abort()
 {
-	if (resp)
+	if(!block_read_stalled)
 	{
-		unsigned char payload[2];
-		payload[0] = (resp << 7) | 2;
-		payload[1] = ~port_stat; //value has to be inverted as we detect low
-		send_bt_response(payload, 2);
+		block_read_closed = 1;
+		return 0;
+	}
+
+	block_read_stalled = 0;
+	block_read_end();
+	return 1;
+}
+
+void block_read_empty(I2C_transfer_t* transfer)
+{
+	unsigned char status = BLOCK_STATUS_LAST;
+
+	if(!request_active)
+		return;
+
+	if(transfer->status != I2C_OK)
+		status |= BLOCK_STATUS_ERROR;
+	if(transfer->status == I2C_TIMEOUT)
+		status |= BLOCK_STATUS_TIMEOUT;
+
+	block_header(tx_payload, transfer->addr | 128, status, 0);
+	protocol_respond(BLOCK_HEADER_LEN);
+}
+
+// returns 1 if the answer is sent later on by the callback of the transfer
+int block_read(unsigned char addr, unsigned int total, unsigned char reg[], int reglen)
+{
+	I2C_transfer_t* transfer = &block_read_transfer;
+	connection_t* data;
+
+	if(total == 0)
+	{
+		// only write the register address, if there is one
+		transfer = &request_transfer;
+		transfer->bus = I2C_DEFAULT_BUS;
+		transfer->addr = addr;
+		transfer->flags = I2C_FIRST | I2C_LAST;
+		transfer->txdata = reg;
+		transfer->txlen = reglen;
+		transfer->rxlen = 0;
+		transfer->callback = block_read_empty;
+
+		I2C_submit(transfer);
+		return 1;
+	}
+
+	block_read_total = total;
+	block_read_done = 0;
+	block_read_seq = seq;
+
+	// the chunks go to the data channel of the host, if it is free
+	block_read_conn = reply_conn;
+	data = connection_data(request_conn);
+	if(!data->tx_pending && !connection_busy(data))
+		block_read_conn = reply_conn = data;
+
+	block_read_active = 1;
+	block_read_request = 1;
+
+	// the register address is written first, if there is one
+	transfer->bus = I2C_DEFAULT_BUS;
+	transfer->addr = addr;
+	transfer->flags = I2C_FIRST;
+	transfer->txdata = reg;
+	transfer->txlen = reglen;
+	transfer->callback = block_read_chunk;
+	block_read_next(transfer);
+
+	I2C_submit(transfer);
+	return 1;
+}
+
+void block_write_done(I2C_transfer_t* transfer)
+{
+	unsigned char status = 0;
+
+	if(!request_active)
+		return;
+
+	if(transfer->status != I2C_OK)
+	{
+		// a NACK already generated the stop condition, a timeout recovered the bus
+		block_active = 0;
+		status = BLOCK_STATUS_ERROR | BLOCK_STATUS_LAST;
+		if(transfer->status == I2C_TIMEOUT)
+			status |= BLOCK_STATUS_TIMEOUT;
 	}
 	else
 	{
-		unsigned char payload[2];
-		payload[0] = (resp << 7) | 2;
-		payload[1] = ~port_stat; //value has to be inverted as we detect low
-		send_bt_request(payload, 2);
+		block_done += transfer->txlen;
+
+		if(transfer->flags & I2C_LAST)
+		{
+			block_active = 0;
+			status = BLOCK_STATUS_LAST;
+		}
 	}
+
+	block_header(tx_payload, transfer->addr, status, block_done);
+	send_bt_response(BLOCK_HEADER_LEN);
+	protocol_complete();
 }
 
-void gpio_request(unsigned char payload[])
+// returns 1 if the answer is sent later on by the callback of the transfer
+int block_write(unsigned char addr, unsigned char flags, unsigned int value, unsigned char data[], unsigned int size)
 {
-	int pingroup = payload[0] & 31;
-	if((payload[0] & 128) == 0 || pingroup != 2 ) //throw an error if not a request or pingroup not 2 as only one supported
-		gpio_err(payload);
-	gpio_send(1, P2IN);
+	I2C_transfer_t* transfer = &request_transfer;
+	unsigned char i2cflags = 0;
+
+	if(flags & BLOCK_FLAG_CONTINUE)
+	{
+		// the continuation has to match the running transfer
+		if(!block_active || addr != block_addr || value != block_done || block_done + size > block_total)
+		{
+			block_abort();
+			block_header(tx_payload, addr, BLOCK_STATUS_ERROR | BLOCK_STATUS_LAST, value);
+			send_bt_response(BLOCK_HEADER_LEN);
+			return 0;
+		}
+	}
+	else
+	{
+		block_abort();
+
+		// the first frame generates the start condition and sends the
+		// address, so it must carry data unless the whole write is empty
+		if(size > value || (size == 0 && value != 0))
+		{
+			block_header(tx_payload, addr, BLOCK_STATUS_ERROR | BLOCK_STATUS_LAST, 0);
+			send_bt_response(BLOCK_HEADER_LEN);
+			return 0;
+		}
+
+		block_active = 1;
+		block_conn = request_conn;
+		block_addr = addr;
+		block_total = value;
+		block_done = 0;
+		i2cflags = I2C_FIRST;
+	}
+
+	if(block_done + size == block_total)
+		i2cflags |= I2C_LAST;
+
+	transfer->bus = I2C_DEFAULT_BUS;
+	transfer->addr = addr;
+	transfer->flags = i2cflags;
+	transfer->txdata = data;
+	transfer->txlen = size;
+	transfer->rxlen = 0;
+	transfer->callback = block_write_done;
+
+	I2C_submit(transfer);
+	return 1;
 }
 
-void protocol(unsigned int BluetoothStackID, Word_t LCID, unsigned char packet[], unsigned int size)
+int block_packet(unsigned char payload[], int size)
+{
+	int rw = payload[0] >> 7;
+	unsigned char addr = payload[0] & 0x7f;
+	unsigned int value = (payload[2] << 8) | payload[3];
+
+	if(size < BLOCK_HEADER_LEN)
+		return 0;
+
+	if (rw)
+		return block_read(addr, value, &payload[BLOCK_HEADER_LEN], size - BLOCK_HEADER_LEN);
+	else
+		return block_write(addr, payload[1], value, &payload[BLOCK_HEADER_LEN], size - BLOCK_HEADER_LEN);
+}
+
+// Control packets give the host information about the device
+// request:  [command][arguments]
+// response: [command | error bit][data]
+#define CTRL_ERROR			0x80
+#define CTRL_INFO			0x00	// returns [window size][rx MTU (16 bit)][tx MTU (16 bit)]
+#define CTRL_SPEED			0x01	// [addr][speed][bus (optional)], sets the bus speed of a device (I2C_SPEED_*), returns [addr][speed][bus]
+#define CTRL_CACHE			0x02	// [addr][ttl (16 bit, ms)][bus (optional)], caches the register reads of a device (ttl 0: off), returns [addr][ttl][bus]
+#define CTRL_CACHE_STATS	0x03	// returns [hits (32 bit)][misses (32 bit)]
+#define CTRL_TX_STATS		0x04	// returns [queue limit][waiting frames][deferred frames (16 bit)][dropped frames (16 bit)] of the channel,
+									// the waiting frames are those queued by the stack plus one held back in the tx buffer
+
+int control_packet(unsigned char payload[], int size, unsigned char out[])
+{
+	if(size < 1)
+		return 0;
+
+	out[0] = payload[0];
+
+	switch (payload[0])
+	{
+	case CTRL_INFO:
+		out[1] = PROTOCOL_WINDOW;
+		out[2] = request_conn->rx_mtu >> 8;
+		out[3] = request_conn->rx_mtu & 0xff;
+		out[4] = request_conn->tx_mtu >> 8;
+		out[5] = request_conn->tx_mtu & 0xff;
+		return 6;
+
+	case CTRL_SPEED:
+		if(size < 3)
+			break;
+		out[3] = size > 3 ? payload[3] : I2C_DEFAULT_BUS;
+		if(I2C_set_speed(out[3], payload[1] & 0x7f, payload[2]))
+			break;
+		out[1] = payload[1] & 0x7f;
+		out[2] = payload[2];
+		return 4;
+
+	case CTRL_CACHE:
+		if(size < 4)
+			break;
+		out[4] = size > 4 ? payload[4] : I2C_DEFAULT_BUS;
+		if(I2C_set_cache(out[4], payload[1] & 0x7f, (payload[2] << 8) | payload[3]))
+			break;
+		out[1] = payload[1] & 0x7f;
+		out[2] = payload[2];
+		out[3] = payload[3];
+		return 5;
+
+	case CTRL_TX_STATS:
+		out[1] = connection_tx_queue(request_conn);
+		out[2] = request_conn->tx_queued + (request_conn->tx_pending ? 1 : 0);
+		out[3] = request_conn->tx_deferred >> 8;
+		out[4] = request_conn->tx_deferred & 0xff;
+		out[5] = request_conn->tx_dropped >> 8;
+		out[6] = request_conn->tx_dropped & 0xff;
+		return 7;
+
+	case CTRL_CACHE_STATS:
+	{
+		unsigned long hits, misses;
+
+		I2C_cache_stats(&hits, &misses);
+		out[1] = hits >> 24;
+		out[2] = hits >> 16;
+		out[3] = hits >> 8;
+		out[4] = hits & 0xff;
+		out[5] = misses >> 24;
+		out[6] = misses >> 16;
+		out[7] = misses >> 8;
+		out[8] = misses & 0xff;
+		return 9;
+	}
+
+	default:
+		break;
+	}
+
+	out[0] |= CTRL_ERROR;
+	return 1;
+}
+
+// returns 1 if the answer is sent later on by the callback of an i2c transfer
+int protocol_handle(unsigned char packet[], unsigned int size)
 {
+	int resplen;
+
 	get_header(packet);
 
+	// a block write is only continued by its own packets, a request of
+	// another connection aborts it as well
+	if(block_active && (block_conn != request_conn || type != 3 || size < 5 || !(packet[4] & BLOCK_FLAG_CONTINUE)))
+		block_abort();
+
 	switch (type)
 	{
-	case 0:	//i2c
-		i2c_packet(&packet[3], size-3);
-		break;
+	case 0:	//i2c: [rw<<7 | addr][len][data]
+		if(size < 5 || i2c_response_len(&packet[3], size-3) > TX_PAYLOAD_MAX)
+			break;
+		request_resplen = i2c_prepare(I2C_DEFAULT_BUS, &packet[3], size-3, tx_payload, &request_transfer);
+		request_transfer.callback = i2c_done;
+		I2C_submit(&request_transfer);
+		return 1;
+
+	case 4:	//i2c on a given bus: [bus][rw<<7 | addr][len][data], the answer starts with the bus
+		if(size < 6 || 1 + i2c_response_len(&packet[4], size-4) > TX_PAYLOAD_MAX)
+			break;
+		tx_payload[0] = packet[3];
+		request_resplen = 1 + i2c_prepare(packet[3], &packet[4], size-4, &tx_payload[1], &request_transfer);
+		request_transfer.callback = i2c_done;
+		I2C_submit(&request_transfer);
+		return 1;
 
 	case 1:	//gpio
-		gpio_request(&packet[3]);
+		resplen = gpio_request(&packet[3], tx_payload);
+		send_bt_response(resplen);
+		break;
+
+	case 2:	//batch
+		if(batch_packet(&packet[3], size-3, tx_payload, TX_PAYLOAD_MAX))
+			return 1;
+		send_bt_response(batch_outlen);
+		break;
+
+	case 3:	//block transfer
+		return block_packet(&packet[3], size-3);
+
+	case 5:	//stream subscriptions
+		resplen = sampler_packet(&packet[3], size-3, tx_payload, TX_PAYLOAD_MAX);
+		send_bt_response(resplen);
+		break;
+
+	case 6:	//programs, a running program answers by itself
+		resplen = program_packet(&packet[3], size-3, tx_payload, TX_PAYLOAD_MAX);
+		if(resplen == 0)
+			return 1;
+		send_bt_response(resplen);
+		break;
+
+	case 7:	//control
+		resplen = control_packet(&packet[3], size-3, tx_payload);
+		send_bt_response(resplen);
 		break;
 
 	default:
 		break;
 	}
+
+	return 0;
 }
 
-void send_port2_status(int port_stat)
+
+// Requests are only queued by protocol(), which is called from the stack
+// callback, and processed later on from the main loop by protocol_process().
+// So the host can keep up to PROTOCOL_WINDOW requests outstanding and the
+// radio is serviced while the i2c transfers are running.
+// Every response echoes the seq of its request, a request which is not
+// accepted because the window is full is answered by an empty response.
+#define rx_queue_slot(conn, i)	(&(conn)->rx_queue[(i) * (conn)->rx_slot_size])
+
+// the connection after the one whose request has been handled last
+int request_next = 0;
+
+// returns the L2CAP channel (gatt 0) or the GATT connection with the given
+// id, id 0 returns a free context
+connection_t* connection_lookup(Word_t id, unsigned char gatt)
 {
-	type = 1;
-	gpio_send(0, port_stat);
+	int i;
+
+	for(i = 0; i < PROTOCOL_MAX_CONNECTIONS; i++)
+	{
+		// the id of a closed connection may already be reused
+		if(connections[i].LCID == id && connections[i].gatt == gatt && !(id && connections[i].closed))
+			return &connections[i];
+	}
+
+	return NULL;
 }
 
+#define connection_find(LCID)	connection_lookup(LCID, 0)
 
+// the data channel of the host of conn, conn itself if there is none
+connection_t* connection_data(connection_t* conn)
+{
+	int i;
+
+	if(conn->data)
+		return conn;
+
+	for(i = 0; i < PROTOCOL_MAX_CONNECTIONS; i++)
+	{
+		connection_t* data = &connections[i];
 
-//value of port2 input
-unsigned int port2_status;
+		if(data->LCID && !data->closed && data->data && data->tx_frame && COMPARE_BD_ADDR(data->BD_ADDR, conn->BD_ADDR))
+			return data;
+	}
+
+	return conn;
+}
 
-void port2_poll()
+void protocol_receive(connection_t* conn, unsigned char packet[], unsigned int size)
 {
-	if((P2IN & 0x0F) != port2_status)
+	int i;
+	int slot;
+
+	if(conn == NULL || size < 3 || size > conn->rx_mtu)
+		return;
+
+	// a request with the same seq as one which is still outstanding is a
+	// retransmission from the host, it is answered only once
+	for(i = 0; i < conn->rx_queue_count; i++)
 	{
-		// only check first 4 bits, ignore rest
-		port2_status = P2IN & 0x0F;
+		if(rx_queue_slot(conn, (conn->rx_queue_head + i) % PROTOCOL_WINDOW)[1] == packet[1])
+			return;
+	}
 
-		if(g_LCID != 0)
+	if(conn->rx_queue_count == PROTOCOL_WINDOW)
+	{
+		LOG_ERROR(("Request window full, rejecting seq %d\r\n", packet[1]));
+		if(conn->tx_frame && !conn->tx_pending)
 		{
-			LOG_INFO(("Send port status\r\n"));
-			send_port2_status(port2_status);
+			// only the header is written, so this does not disturb a
+			// running request. Its header is needed for its answer though
+			connection_t* reqconn = request_conn;
+			connection_t* repconn = reply_conn;
+			int reqtype = type;
+			int reqseq = seq;
+
+			request_conn = conn;
+			reply_conn = conn;
+			get_header(packet);
+			send_bt_response(0);
+
+			request_conn = reqconn;
+			reply_conn = repconn;
+			type = reqtype;
+			seq = reqseq;
 		}
+		return;
 	}
+
+	slot = (conn->rx_queue_head + conn->rx_queue_count) % PROTOCOL_WINDOW;
+	memcpy(rx_queue_slot(conn, slot), packet, size);
+	conn->rx_queue_len[slot] = size;
+	conn->rx_queue_count++;
+}
+
+void protocol(unsigned int BluetoothStackID, Word_t LCID, unsigned char packet[], unsigned int size)
+{
+	protocol_receive(connection_find(LCID), packet, size);
+}
+
+// returns 1 if the request has to wait for the running block read: only
+// gpio and control requests and i2c requests on another bus pass it
+int request_blocked(unsigned char packet[], unsigned int size)
+{
+	int reqtype = packet[0] >> 5;
+
+	if(!block_read_active)
+		return 0;
+
+	if(reqtype == 1 || reqtype == 7)
+		return 0;
+
+	return !(reqtype == 4 && size > 3 && packet[3] != I2C_DEFAULT_BUS);
+}
+
+// handles the next request, the connections take turns so every host gets
+// its share of the bus. Control channels are served first.
+void protocol_process()
+{
+	int pass;
+	int i;
+
+	// frames which did not fit into the queue of the stack are sent again
+	// once it has drained. Closed connections are cleaned up here rather
+	// than in the callback of the stack, as this may have to wait for the
+	// running transfer
+	for(i = 0; i < PROTOCOL_MAX_CONNECTIONS; i++)
+	{
+		connection_t* conn = &connections[i];
+
+		if(conn->closed)
+			connection_cleanup(conn);
+
+		if(conn->tx_pending && conn->tx_retry)
+		{
+			conn->tx_retry = 0;
+			send_frame(conn, conn->tx_pending);
+		}
+	}
+
+	// a block read continues once its last chunk has been sent
+	if(block_read_stalled && !block_read_conn->tx_pending)
+	{
+		block_read_stalled = 0;
+		block_read_continue(&block_read_transfer);
+	}
+
+	if(request_active)
+		return;
+
+	for(pass = 0; pass < 2; pass++)
+	{
+		for(i = 0; i < PROTOCOL_MAX_CONNECTIONS; i++)
+		{
+			connection_t* conn = &connections[(request_next + i) % PROTOCOL_MAX_CONNECTIONS];
+
+			// requests are kept until the tx MTU is known and the tx buffer
+			// is free, and while a block read holds the bus they need
+			if(conn->data != pass || conn->rx_queue_count == 0 || conn->tx_frame == NULL || conn->tx_pending
+				|| connection_busy(conn) || request_blocked(rx_queue_slot(conn, conn->rx_queue_head), conn->rx_queue_len[conn->rx_queue_head]))
+				continue;
+
+			request_next = (conn - connections + 1) % PROTOCOL_MAX_CONNECTIONS;
+			request_conn = conn;
+			reply_conn = conn;
+
+			// the slot stays occupied while it is handled, so it is not overwritten
+			request_active = 1;
+			if(!protocol_handle(rx_queue_slot(conn, conn->rx_queue_head), conn->rx_queue_len[conn->rx_queue_head]))
+				protocol_complete();
+			return;
+		}
+	}
+}
+
+// frees the slot of the request which has been answered
+void protocol_complete()
+{
+	request_active = 0;
+
+	// the queue may have been flushed by a disconnect in the meantime
+	if(request_conn->rx_queue_count)
+	{
+		request_conn->rx_queue_head = (request_conn->rx_queue_head + 1) % PROTOCOL_WINDOW;
+		request_conn->rx_queue_count--;
+	}
+}
+
+// answers the running request, for requests which finish asynchronously
+void protocol_respond(int paylen)
+{
+	if(!request_active)
+		return;
+
+	send_bt_response(paylen);
+	protocol_complete();
+}
+
+int protocol_pending()
+{
+	int i;
+	int count = 0;
+
+	for(i = 0; i < PROTOCOL_MAX_CONNECTIONS; i++)
+		count += connections[i].rx_queue_count + (connections[i].tx_pending != 0);
+
+	return count;
+}
+
+// the stack has room for frames of the channel again
+void protocol_tx_ready(Word_t LCID)
+{
+	connection_t* conn = connection_find(LCID);
+
+	if(conn && LCID)
+	{
+		conn->tx_retry = 1;
+		conn->tx_queued = PROTOCOL_TX_LOW;
+	}
+}
+
+// the channel for the unsolicited packets which belong to the request which
+// is handled (subscriptions), the data channel of its host if it has one
+int protocol_channel()
+{
+	return connection_data(request_conn) - connections;
+}
+
+// gives other modules access to the payload of the outgoing frame of a
+// channel, NULL if there is no connection to send it to or the buffer is
+// in use
+unsigned char* protocol_tx_payload(int channel, unsigned int *maxlen)
+{
+	connection_t* conn = &connections[channel];
+
+	if(conn->LCID == 0 || conn->closed || conn->tx_frame == NULL || conn->tx_pending || connection_busy(conn))
+		return NULL;
+
+	*maxlen = conn->tx_mtu - TX_HEADER_LEN;
+	return &conn->tx_frame[TX_HEADER_LEN];
+}
+
+// keeps the payload returned by protocol_tx_payload() while an i2c transfer
+// reads into it, nobody else uses the buffer until it is released. The
+// connection is not cleaned up meanwhile.
+void protocol_tx_hold(int channel)
+{
+	connections[channel].tx_held = 1;
+}
+
+void protocol_tx_release(int channel)
+{
+	connections[channel].tx_held = 0;
+}
+
+// the tx buffer of the connection is used by the running request, block read
+// or sample
+int connection_busy(connection_t* conn)
+{
+	return (request_active && conn == reply_conn) || (block_read_active && conn == block_read_conn) || conn->tx_held;
+}
+
+// the bus must not be used by anyone else while a block transfer holds it or
+// a request is running
+int protocol_bus_held()
+{
+	return block_active || block_read_active || request_active;
+}
+
+// Every edge on port 2 is recorded by the ISR together with a timestamp and
+// sent to the host in batched unsolicited gpio packets:
+// [GPIO_EVENTS | lost flag | pingroup][count] followed by count events of
+// [port value][timestamp (16 bit)]
+// The timestamp is taken from TB0 which runs from ACLK (32768 Hz) and keeps
+// running in LPM3. The lost flag is set if the FIFO has overflown since the
+// last packet.
+#define GPIO_EVENTS			0x40
+#define GPIO_EVENTS_LOST	0x20
+#define GPIO_EVENT_LEN		3
+
+#ifndef GPIO_FIFO_SIZE
+#define GPIO_FIFO_SIZE		16		// has to be a power of 2
+#endif
+
+typedef struct
+{
+	unsigned char value;
+	unsigned int time;
+} gpio_event_t;
+
+// single producer (ISR) and single consumer (main loop), the head is only
+// written by the ISR and the tail only by the main loop
+gpio_event_t gpio_fifo[GPIO_FIFO_SIZE];
+volatile unsigned char gpio_fifo_head = 0;
+volatile unsigned char gpio_fifo_tail = 0;
+volatile unsigned char gpio_fifo_lost = 0;
+
+int port2_events_pending()
+{
+	return gpio_fifo_head != gpio_fifo_tail;
+}
+
+// sends all recorded events to every connection, called from the main loop
+void port2_flush()
+{
+	unsigned char head = gpio_fifo_head;
+	unsigned char tail = gpio_fifo_tail;
+	unsigned char lost;
+	int max = 0;
+	int count = 0;
+	int i;
+
+	if(tail == head)
+		return;
+
+	// the number of events which fit into the smallest frame is sent
+	for(i = 0; i < PROTOCOL_MAX_CONNECTIONS; i++)
+	{
+		connection_t* conn = &connections[i];
+		int fit;
+
+		if(conn->LCID == 0 || conn->closed || conn->tx_frame == NULL || conn->data)
+			continue;
+
+		// tx_frame is in use by a running request or waits for the stack,
+		// try again later
+		if(connection_busy(conn) || conn->tx_pending)
+			return;
+
+		fit = (conn->tx_mtu - TX_HEADER_LEN - 2) / GPIO_EVENT_LEN;
+		if(max == 0 || fit < max)
+			max = fit;
+	}
+
+	// nobody to tell, the events are dropped. The ISR may add events and
+	// set the lost flag meanwhile, so it is read and cleared with the
+	// interrupts disabled.
+	__disable_interrupt();
+	if(max == 0)
+	{
+		gpio_fifo_tail = head;
+		gpio_fifo_lost = 0;
+		__enable_interrupt();
+		return;
+	}
+
+	lost = gpio_fifo_lost;
+	gpio_fifo_lost = 0;
+	__enable_interrupt();
+
+	for(i = 0; i < PROTOCOL_MAX_CONNECTIONS; i++)
+	{
+		connection_t* conn = &connections[i];
+		unsigned char* payload = &conn->tx_frame[TX_HEADER_LEN];
+
+		if(conn->LCID == 0 || conn->closed || conn->tx_frame == NULL || conn->data)
+			continue;
+
+		payload[0] = GPIO_EVENTS | 2;
+		if(lost)
+			payload[0] |= GPIO_EVENTS_LOST;
+
+		tail = gpio_fifo_tail;
+		count = 0;
+
+		while(tail != head && count < max)
+		{
+			gpio_event_t *event = &gpio_fifo[tail];
+			unsigned char* out = &payload[2 + count*GPIO_EVENT_LEN];
+
+			out[0] = ~event->value; //value has to be inverted as we detect low
+			out[1] = event->time >> 8;
+			out[2] = event->time & 0xff;
+
+			count++;
+			tail = (tail + 1) & (GPIO_FIFO_SIZE - 1);
+		}
+
+		payload[1] = count;
+
+		LOG_INFO(("Send %d port events\r\n", count));
+		send_bt_request(i, 1, 2 + count*GPIO_EVENT_LEN);
+	}
+
+	// the slots may be reused by the ISR from now on
+	gpio_fifo_tail = tail;
+}
+
+// TB0 runs asynchronous to MCLK, so the counter is read until two
+// consecutive reads match
+unsigned int port2_timestamp()
+{
+	unsigned int time;
+
+	do
+	{
+		time = TB0R;
+	} while(time != TB0R);
+
+	return time;
 }
 
 #pragma vector = PORT2_VECTOR
 __interrupt void PORT2_ISR(void)
 {
+	unsigned int time = port2_timestamp();
+	unsigned char value = P2IN;
+	unsigned char changed = P2IFG;
+	unsigned char next = (gpio_fifo_head + 1) & (GPIO_FIFO_SIZE - 1);
+
 	// this is used to wake MSP from low power mode if necessary
 	LPM3_EXIT;
 
-	P2IES = P2IN;
+	P2IES = value;
 
 	P2IFG = 0;
+
+	// data-ready lines start their reads right away
+	sampler_trigger(changed, value, time);
+
+	if(next == gpio_fifo_tail)
+	{
+		gpio_fifo_lost = 1;
+	}
+	else
+	{
+		// only check first 4 bits, ignore rest
+		gpio_fifo[gpio_fifo_head].value = value & 0x0F;
+		gpio_fifo[gpio_fifo_head].time = time;
+		gpio_fifo_head = next;
+	}
 }
 
 
 
 
-int l2cap_send(unsigned int BluetoothStackID, Word_t LCID, uint8_t *data, uint16_t len)
+// returns 0 or the error code of the stack, BTPS_ERROR_INSUFFICIENT_RESOURCES
+// if the queue of the channel is full
+int l2cap_send(unsigned int BluetoothStackID, Word_t LCID, uint8_t *data, uint16_t len, unsigned int queue)
 {
-	int retval = L2CA_Data_Write(BluetoothStackID,
+	L2CA_Queueing_Parameters_t queueing;
+	int retval;
+
+	queueing.Flags = L2CA_QUEUEING_FLAG_LIMIT_BY_PACKETS;
+	queueing.QueueLimit = queue;
+	queueing.LowThreshold = PROTOCOL_TX_LOW;
+
+	retval = L2CA_Enhanced_Data_Write(BluetoothStackID,
 					LCID,
+					&queueing,
 					len,
 					data);
 
-	if(retval)
+	if(retval && retval != BTPS_ERROR_INSUFFICIENT_RESOURCES)
+		LOG_ERROR(("L2CA_Enhanced_Data_Write failed: error code %d\r\n", retval));
+
+	return retval;
+}
+
+// allocates a buffer for count frames of up to mtu bytes, the size is halved
+// down to FRAME_MIN while the heap is short. The size which could be
+// allocated is returned in mtu
+unsigned char* alloc_frame_buffer(unsigned int *mtu, unsigned int count)
+{
+	unsigned char* buffer;
+
+	while((buffer = BTPS_AllocateMemory((unsigned long)*mtu * count)) == NULL && *mtu > FRAME_MIN)
+		*mtu = (*mtu / 2 > FRAME_MIN) ? *mtu / 2 : FRAME_MIN;
+
+	return buffer;
+}
+
+// returns the MTU which should be announced to the host, 0 if there is not
+// enough memory or no free context to accept the connection. data is set for
+// channels of the data PSM
+Word_t connectionOpened(unsigned int BluetoothStackID, Word_t LCID, BD_ADDR_t BD_ADDR, int data)
+{
+	connection_t* conn = connection_find(0);
+
+	if(conn == NULL)
 	{
-		LOG_ERROR(("L2CA_Data_Write failed: error code %d\r\n", retval));
+		LOG_ERROR(("Too many connections, refusing connection\r\n"));
+		return 0;
+	}
+
+	g_BluetoothStackID = BluetoothStackID;
+
+	return connection_open(conn, LCID, BD_ADDR, data ? 1 : 0, 0);
+}
 
+// sets up a free context, returns the MTU of the request queue or 0
+Word_t connection_open(connection_t* conn, Word_t id, BD_ADDR_t BD_ADDR, unsigned char data, unsigned char gatt)
+{
+	conn->rx_slot_size = PROTOCOL_MAX_MTU;
+	conn->rx_queue = alloc_frame_buffer(&conn->rx_slot_size, PROTOCOL_WINDOW);
+	if(conn->rx_queue == NULL)
+	{
+		LOG_ERROR(("Not enough memory for the request queue\r\n"));
+		conn->rx_slot_size = 0;
 		return 0;
 	}
 
-	return 1;
+	conn->rx_mtu = conn->rx_slot_size;
+	conn->LCID = id;
+	conn->BD_ADDR = BD_ADDR;
+	conn->data = data;
+	conn->gatt = gatt;
+	conn->gatt_config = 0;
+	conn->ownseq = 0;
+	conn->tx_pending = 0;
+	conn->tx_retry = 0;
+	conn->tx_deferred = 0;
+	conn->tx_dropped = 0;
+	conn->tx_queued = 0;
+	conn->rx_queue_head = 0;
+	conn->rx_queue_count = 0;
+
+	return conn->rx_mtu;
+}
+
+// called when the host told us its MTU, the tx buffer is sized accordingly
+void connectionConfigured(Word_t LCID, Word_t OutMTU)
+{
+	connection_t* conn = connection_find(LCID);
+
+	if(conn)
+		connection_tx_mtu(conn, OutMTU);
+}
+
+void connection_tx_mtu(connection_t* conn, Word_t OutMTU)
+{
+	unsigned int max;
+
+	// the buffer must not be replaced under a running request
+	if(connection_busy(conn))
+		return;
+
+	if(conn->tx_frame)
+		BTPS_FreeMemory(conn->tx_frame);
+
+	// a frame waiting for the stack is lost with the buffer
+	if(conn->tx_pending)
+		conn->tx_dropped++;
+	conn->tx_pending = 0;
+
+	max = conn->data ? PROTOCOL_DATA_MAX_MTU : PROTOCOL_MAX_MTU;
+	conn->tx_mtu = (OutMTU < max) ? OutMTU : max;
+	conn->tx_frame = alloc_frame_buffer(&conn->tx_mtu, 1);
+	if(conn->tx_frame == NULL)
+	{
+		LOG_ERROR(("Not enough memory for the tx buffer\r\n"));
+		conn->tx_mtu = 0;
+	}
+}
+
+// the host accepted (InMTU == 0) or lowered the MTU we announced
+void connectionConfirmed(Word_t LCID, Word_t InMTU)
+{
+	connection_t* conn = connection_find(LCID);
+
+	if(conn && InMTU && InMTU < conn->rx_mtu)
+		conn->rx_mtu = InMTU;
+}
+
+void connectionClosed(Word_t LCID)
+{
+	connection_t* conn = connection_find(LCID);
+
+	if(conn && LCID)
+		connection_close(conn);
+}
+
+// called from the callbacks of the stack: no more requests are taken and
+// no frames are sent anymore, the rest is left to connection_cleanup()
+void connection_close(connection_t* conn)
+{
+	conn->closed = 1;
+	conn->rx_queue_count = 0;
+	conn->tx_pending = 0;
+}
+
+void connection_cleanup(connection_t* conn)
+{
+	// the tx buffer of the connection may still be used by the running chunk,
+	// the cleanup is retried once it has finished
+	if(block_read_active && (conn == block_read_conn || (block_read_request && conn == request_conn)))
+	{
+		if(!block_read_abort())
+			return;
+	}
+
+	// a sample is still read into the tx buffer
+	if(conn->tx_held)
+		return;
+
+	if(request_active && (conn == request_conn || conn == reply_conn))
+	{
+		// the running transfer may still use the buffers, its callback
+		// must not continue the request
+		I2C_wait();
+		request_active = 0;
+		program_abort();
+		I2C_process();
+	}
+
+	if(block_active && conn == block_conn)
+		block_abort();
+
+	sampler_reset(conn - connections);
+
+	conn->rx_queue_count = 0;
+	conn->tx_pending = 0;
+	conn->LCID = 0;
+	conn->gatt = 0;
+	conn->closed = 0;
+
+	if(conn->rx_queue)
+		BTPS_FreeMemory(conn->rx_queue);
+	if(conn->tx_frame)
+		BTPS_FreeMemory(conn->tx_frame);
+
+	conn->rx_queue = NULL;
+	conn->tx_frame = NULL;
+	conn->rx_slot_size = 0;
+	conn->rx_mtu = 0;
+	conn->tx_mtu = 0;
+}
+
+#ifdef __SUPPORT_LOW_ENERGY__
+// A GATT connection carries the same frames as an L2CAP channel: the requests
+// are written to the request characteristic, answers and events are notified
+// on the response characteristic. A frame has to fit into one ATT packet, so
+// both directions are limited to the ATT MTU less the ATT header.
+#define ATT_HEADER_LEN	3
+
+// the client negotiated another ATT MTU
+void gattMTU(unsigned int ConnectionID, Word_t MTU)
+{
+	connection_t* conn = connection_lookup(ConnectionID, 1);
+
+	if(conn == NULL || MTU <= ATT_HEADER_LEN)
+		return;
+
+	conn->rx_mtu = (MTU - ATT_HEADER_LEN < conn->rx_slot_size) ? MTU - ATT_HEADER_LEN : conn->rx_slot_size;
+	connection_tx_mtu(conn, MTU - ATT_HEADER_LEN);
 }
 
-void connectionOpened(unsigned int BluetoothStackID, Word_t LCID)
+// returns the MTU of the request queue, 0 if the connection is refused
+Word_t gattOpened(unsigned int BluetoothStackID, unsigned int ConnectionID, BD_ADDR_t BD_ADDR, Word_t MTU)
 {
+	connection_t* conn = connection_find(0);
+
+	if(conn == NULL)
+	{
+		LOG_ERROR(("Too many connections, refusing connection\r\n"));
+		return 0;
+	}
+
 	g_BluetoothStackID = BluetoothStackID;
-	g_LCID = LCID;
+
+	if(!connection_open(conn, ConnectionID, BD_ADDR, 0, 1))
+		return 0;
+
+	gattMTU(ConnectionID, MTU);
+	return conn->rx_mtu;
+}
+
+void gattReceived(unsigned int ConnectionID, unsigned char packet[], unsigned int size)
+{
+	protocol_receive(connection_lookup(ConnectionID, 1), packet, size);
 }
 
-void connectionClosed()
+void gattTxReady(unsigned int ConnectionID)
 {
-	g_LCID = 0;
+	connection_t* conn = connection_lookup(ConnectionID, 1);
+
+	if(conn)
+	{
+		conn->tx_retry = 1;
+		conn->tx_queued = 0;
+	}
+}
+
+// the client (un)subscribed to the notifications of the response
+// characteristic
+void gattConfigure(unsigned int ConnectionID, Word_t Configuration)
+{
+	connection_t* conn = connection_lookup(ConnectionID, 1);
+
+	if(conn)
+		conn->gatt_config = Configuration;
+}
+
+Word_t gattConfiguration(unsigned int ConnectionID)
+{
+	connection_t* conn = connection_lookup(ConnectionID, 1);
+
+	return conn ? conn->gatt_config : 0;
+}
+
+void gattClosed(unsigned int ConnectionID)
+{
+	connection_t* conn = connection_lookup(ConnectionID, 1);
+
+	if(conn)
+		connection_close(conn);
 }
+#endif
@@ -9,12 +9,41 @@
 #define PROTOCOL_H_
 
 void protocol(unsigned int BluetoothStackID, Word_t LCID, unsigned char packet[], unsigned int size);
-void send_port2_status(int port_stat);
+void protocol_process();
+int protocol_pending();
+int protocol_bus_held();
+void protocol_respond(int paylen);
 
-void port2_poll();
+// unsolicited packets: the payload is written in place to the buffer returned
+// by protocol_tx_payload() and then sent by send_bt_request(). A channel is
+// one of the connected L2CAP channels, protocol_channel() is the one which
+// belongs to the request that is handled (the data channel of its host, if
+// it has opened one). The buffer is held while a transfer reads into it.
+int protocol_channel();
+unsigned char* protocol_tx_payload(int channel, unsigned int *maxlen);
+void protocol_tx_hold(int channel);
+void protocol_tx_release(int channel);
+void send_bt_request(int channel, int reqtype, int paylen);
 
-void connectionOpened(unsigned int BluetoothStackID, Word_t LCID);
+void port2_flush();
+int port2_events_pending();
 
-void connectionClosed();
+Word_t connectionOpened(unsigned int BluetoothStackID, Word_t LCID, BD_ADDR_t BD_ADDR, int data);
+void connectionConfigured(Word_t LCID, Word_t OutMTU);
+void connectionConfirmed(Word_t LCID, Word_t InMTU);
+
+void connectionClosed(Word_t LCID);
+void protocol_tx_ready(Word_t LCID);
+
+#ifdef __SUPPORT_LOW_ENERGY__
+// GATT connections of the bridge service, see L2CAPServer.c
+Word_t gattOpened(unsigned int BluetoothStackID, unsigned int ConnectionID, BD_ADDR_t BD_ADDR, Word_t MTU);
+void gattMTU(unsigned int ConnectionID, Word_t MTU);
+void gattReceived(unsigned int ConnectionID, unsigned char packet[], unsigned int size);
+void gattTxReady(unsigned int ConnectionID);
+void gattConfigure(unsigned int ConnectionID, Word_t Configuration);
+Word_t gattConfiguration(unsigned int ConnectionID);
+void gattClosed(unsigned int ConnectionID);
+#endif
 
 #endif /* PROTOCOL_H_ */
@@ -0,0 +1,782 @@
+
+#include <msp430x54x.h>
+#include <string.h>
+
+#include "Main.h"                /* Application Interface Abstraction.        */
+#include "SS1BTPS.h"             /* Main SS1 Bluetooth Stack Header.          */
+#include "L2CAPServer.h"         /* Application Header.                       */
+#include "BTPSKRNL.h"            /* BTPS Kernel Header.                       */
+
+#include "I2C.h"
+#include "protocol.h"
+#include "sampler.h"
+
+// The host subscribes to an i2c register read which is then run periodically
+// by the device, every result is pushed to the host as unsolicited packet.
+// A read can also be triggered by an edge on one of the port 2 inputs (the
+// data-ready line of a sensor). It is submitted right from the port ISR and
+// its timestamp is the TB0 time of the edge (ACLK ticks) instead of ms. The
+// lost bit is set if edges have been missed because the last sample had not
+// been sent yet.
+// request:      [command][arguments]
+// response:     [command | error bit][data]
+// notification: [STREAM_SAMPLE | error bit | lost bit][id][timestamp (16 bit, ms or ticks)][data]
+#define STREAM_TYPE			5
+
+#define STREAM_ERROR		0x80
+#define STREAM_LOST			0x40
+#define STREAM_SUBSCRIBE	0x00	// [addr][register][length][period (16 bit, ms)][bus (optional)], returns [id]
+#define STREAM_UNSUBSCRIBE	0x01	// [id], returns [id]
+#define STREAM_SAMPLE		0x02
+#define STREAM_TRIGGER		0x03	// [addr][register][length][pin][edge (0: falling, 1: rising)][bus (optional)], returns [id]
+#define STREAM_AGGREGATE	0x04	// [id][mode][window][format], returns [id]
+#define STREAM_RULE			0x05	// [id][rule][format][value index][threshold or mask (16 bit)], returns [id]
+#define STREAM_STATS		0x06
+
+// The samples of a subscription can be aggregated over a window of samples
+// before anything is sent: AGGREGATE_DECIMATE only sends every window-th
+// sample, AGGREGATE_STATS splits the data of the samples into values
+// (format) and sends min, max and mean of every value once per window:
+// [STREAM_STATS | error bit | lost bit][id][timestamp][count][min][max][mean]...
+// count is the number of samples which have been read successfully, min,
+// max and mean are 16 bit. The error bit is set if any read has failed.
+#define AGGREGATE_OFF		0
+#define AGGREGATE_DECIMATE	1
+#define AGGREGATE_STATS		2
+
+#define FORMAT_16BIT		0x01	// else 8 bit values
+#define FORMAT_LITTLE		0x02	// 16 bit values are little endian
+#define FORMAT_SIGNED		0x04
+
+#define STREAM_STATS_HEADER_LEN	5
+#define STREAM_STATS_VALUE_LEN	6
+
+// A rule filters the raw (and decimated) samples of a subscription, a
+// sample is only sent if the rule fires for one of its values (the index
+// counts values of the given format). Failed reads are always sent.
+// RULE_ABOVE/RULE_BELOW fire when the value crosses the threshold in
+// either direction, so the host always knows on which side it is.
+// RULE_DELTA fires when the value differs from the last one sent by more
+// than the threshold, RULE_CHANGE when one of the bits in the mask has
+// changed since then. The first sample is always sent.
+#define RULE_OFF			0
+#define RULE_ABOVE			1
+#define RULE_BELOW			2
+#define RULE_DELTA			3
+#define RULE_CHANGE			4
+
+#ifndef SAMPLER_AGGREGATE_VALUES
+#define SAMPLER_AGGREGATE_VALUES	4
+#endif
+
+#define STREAM_SAMPLE_HEADER_LEN	4
+
+#ifndef SAMPLER_MAX_SUBSCRIPTIONS
+#define SAMPLER_MAX_SUBSCRIPTIONS	4
+#endif
+
+// triggered and aggregated samples are read into the subscription, so their
+// length is limited
+#ifndef SAMPLER_TRIGGER_DATA
+#define SAMPLER_TRIGGER_DATA		16
+#endif
+
+// state of the read of a sample
+#define SAMPLE_IDLE			0
+#define SAMPLE_TRIGGERED	1	// the bus was held, the read is submitted by sampler_poll()
+#define SAMPLE_READING		2
+#define SAMPLE_READY		3	// waiting to be sent
+
+typedef struct
+{
+	unsigned char active;
+	unsigned char channel;		// the host which has subscribed
+	unsigned char bus;
+	unsigned char addr;
+	unsigned char reg;
+	unsigned char len;
+	unsigned int period;
+	unsigned long due;
+
+	// triggered reads
+	unsigned char pin;			// 0: periodic
+	unsigned char edge;
+	volatile unsigned char state;
+	unsigned char lost;
+	unsigned char error;
+	unsigned int time;
+	I2C_transfer_t transfer;
+	unsigned char data[SAMPLER_TRIGGER_DATA];
+
+	// aggregation
+	unsigned char mode;
+	unsigned char window;
+	unsigned char format;
+	unsigned char samples;		// samples in the window so far
+	unsigned char count;		// successful ones
+	unsigned char failed;
+	long min[SAMPLER_AGGREGATE_VALUES];
+	long max[SAMPLER_AGGREGATE_VALUES];
+	long sum[SAMPLER_AGGREGATE_VALUES];
+
+	// report on change
+	unsigned char rule;
+	unsigned char rule_format;
+	unsigned char rule_index;
+	unsigned char reported;		// a sample has been sent, last is valid
+	unsigned char side;			// the value was beyond the threshold
+	unsigned int threshold;
+	long last;
+} subscription_t;
+
+subscription_t subscriptions[SAMPLER_MAX_SUBSCRIPTIONS];
+
+
+int sampler_subscribe(unsigned char payload[], int size, unsigned char out[], unsigned int outsize)
+{
+	int id;
+	unsigned int period;
+
+	if(size < 6)
+		return 0;
+
+	period = (payload[4] << 8) | payload[5];
+
+	// the sample has to fit into a single packet
+	if(payload[3] == 0 || period == 0 || (size > 6 && !I2C_bus_enabled(payload[6])) || payload[3] + STREAM_SAMPLE_HEADER_LEN > outsize)
+		return 0;
+
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		// the read of a triggered sample may still be running
+		if(!subscriptions[id].active && subscriptions[id].state == SAMPLE_IDLE)
+		{
+			subscriptions[id].bus = size > 6 ? payload[6] : I2C_DEFAULT_BUS;
+			subscriptions[id].addr = payload[1] & 0x7f;
+			subscriptions[id].reg = payload[2];
+			subscriptions[id].len = payload[3];
+			subscriptions[id].period = period;
+			subscriptions[id].due = BTPS_GetTickCount() + period;
+			subscriptions[id].pin = 0;
+			subscriptions[id].lost = 0;
+			subscriptions[id].mode = AGGREGATE_OFF;
+			subscriptions[id].rule = RULE_OFF;
+			subscriptions[id].channel = protocol_channel();
+			subscriptions[id].active = 1;
+
+			out[1] = id;
+			return 2;
+		}
+	}
+
+	LOG_ERROR(("No free subscription\r\n"));
+	return 0;
+}
+
+int sampler_subscribe_trigger(unsigned char payload[], int size, unsigned char out[], unsigned int outsize)
+{
+	int id;
+
+	if(size < 6)
+		return 0;
+
+	if(payload[3] == 0 || payload[3] > SAMPLER_TRIGGER_DATA || payload[4] > 3 || (size > 6 && !I2C_bus_enabled(payload[6])) || payload[3] + STREAM_SAMPLE_HEADER_LEN > outsize)
+		return 0;
+
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		subscription_t *sub = &subscriptions[id];
+
+		if(!sub->active && sub->state == SAMPLE_IDLE)
+		{
+			sub->bus = size > 6 ? payload[6] : I2C_DEFAULT_BUS;
+			sub->addr = payload[1] & 0x7f;
+			sub->reg = payload[2];
+			sub->len = payload[3];
+			sub->pin = 1 << payload[4];
+			sub->edge = payload[5] ? sub->pin : 0;
+			sub->lost = 0;
+			sub->mode = AGGREGATE_OFF;
+			sub->rule = RULE_OFF;
+			sub->channel = protocol_channel();
+
+			// armed last, the port ISR may trigger it right away
+			sub->active = 1;
+
+			out[1] = id;
+			return 2;
+		}
+	}
+
+	LOG_ERROR(("No free subscription\r\n"));
+	return 0;
+}
+
+// number of values in the data of a sample
+int sampler_values(subscription_t *sub)
+{
+	return (sub->format & FORMAT_16BIT) ? sub->len / 2 : sub->len;
+}
+
+void sampler_window_reset(subscription_t *sub)
+{
+	sub->samples = 0;
+	sub->count = 0;
+	sub->failed = 0;
+}
+
+int sampler_aggregate(unsigned char payload[], int size, unsigned char out[], unsigned int outsize)
+{
+	subscription_t *sub;
+	unsigned short state;
+
+	if(size < 5 || payload[1] >= SAMPLER_MAX_SUBSCRIPTIONS)
+		return 0;
+
+	sub = &subscriptions[payload[1]];
+
+	if(!sub->active || sub->channel != protocol_channel() || payload[2] > AGGREGATE_STATS || (payload[2] != AGGREGATE_OFF && payload[3] == 0))
+		return 0;
+
+	// the samples are collected in the subscription
+	if(payload[2] != AGGREGATE_OFF && sub->len > SAMPLER_TRIGGER_DATA)
+		return 0;
+
+	state = __get_interrupt_state();
+	__disable_interrupt();
+
+	sub->format = payload[4];
+
+	if(payload[2] == AGGREGATE_STATS && (sampler_values(sub) == 0 || sampler_values(sub) > SAMPLER_AGGREGATE_VALUES
+		|| STREAM_STATS_HEADER_LEN + sampler_values(sub) * STREAM_STATS_VALUE_LEN > outsize))
+	{
+		__set_interrupt_state(state);
+		return 0;
+	}
+
+	sub->mode = payload[2];
+	sub->window = payload[3];
+	sampler_window_reset(sub);
+
+	__set_interrupt_state(state);
+
+	out[1] = payload[1];
+	return 2;
+}
+
+// value i of the data in the given format
+long sampler_value(unsigned char data[], unsigned char format, int i)
+{
+	long value;
+
+	if(format & FORMAT_16BIT)
+	{
+		if(format & FORMAT_LITTLE)
+			value = data[2*i] | (data[2*i+1] << 8);
+		else
+			value = (data[2*i] << 8) | data[2*i+1];
+		value &= 0xffff;
+		if((format & FORMAT_SIGNED) && value > 0x7fff)
+			value -= 0x10000;
+	}
+	else
+	{
+		value = data[i];
+		if((format & FORMAT_SIGNED) && value > 0x7f)
+			value -= 0x100;
+	}
+
+	return value;
+}
+
+// adds a sample to the window, returns 1 if the window is complete
+int sampler_accumulate(subscription_t *sub, int error)
+{
+	int values = sampler_values(sub);
+	int i;
+
+	sub->samples++;
+
+	if(error)
+		sub->failed = 1;
+	else if(sub->mode == AGGREGATE_STATS)
+	{
+		for(i = 0; i < values; i++)
+		{
+			long value = sampler_value(sub->data, sub->format, i);
+
+			if(sub->count == 0 || value < sub->min[i])
+				sub->min[i] = value;
+			if(sub->count == 0 || value > sub->max[i])
+				sub->max[i] = value;
+			if(sub->count == 0)
+				sub->sum[i] = 0;
+			sub->sum[i] += value;
+		}
+
+		sub->count++;
+	}
+	else
+		sub->count++;
+
+	return sub->samples >= sub->window;
+}
+
+// writes the statistics of the window to out, returns the length
+int sampler_stats(int id, unsigned char out[])
+{
+	subscription_t *sub = &subscriptions[id];
+	int values = sub->count ? sampler_values(sub) : 0;
+	int pos = STREAM_STATS_HEADER_LEN;
+	int i;
+
+	out[4] = sub->count;
+
+	for(i = 0; i < values; i++)
+	{
+		// the only division per window, the samples are just added up
+		long mean = sub->sum[i] / sub->count;
+
+		out[pos++] = sub->min[i] >> 8;
+		out[pos++] = sub->min[i] & 0xff;
+		out[pos++] = sub->max[i] >> 8;
+		out[pos++] = sub->max[i] & 0xff;
+		out[pos++] = mean >> 8;
+		out[pos++] = mean & 0xff;
+	}
+
+	return pos;
+}
+
+int sampler_set_rule(unsigned char payload[], int size, unsigned char out[])
+{
+	subscription_t *sub;
+	int width;
+
+	if(size < 7 || payload[1] >= SAMPLER_MAX_SUBSCRIPTIONS)
+		return 0;
+
+	sub = &subscriptions[payload[1]];
+	width = (payload[3] & FORMAT_16BIT) ? 2 : 1;
+
+	if(!sub->active || sub->channel != protocol_channel() || payload[2] > RULE_CHANGE || (payload[2] != RULE_OFF && (payload[4] + 1) * width > sub->len))
+		return 0;
+
+	sub->rule = RULE_OFF;
+	sub->rule_format = payload[3];
+	sub->rule_index = payload[4];
+	sub->threshold = (payload[5] << 8) | payload[6];
+	sub->reported = 0;
+	sub->rule = payload[2];
+
+	out[1] = payload[1];
+	return 2;
+}
+
+// returns 1 if the sample has to be sent
+int sampler_rule(subscription_t *sub, unsigned char data[], int error)
+{
+	long value;
+	long threshold;
+	unsigned char side;
+	int fire;
+
+	if(error || sub->rule == RULE_OFF || sub->mode == AGGREGATE_STATS)
+		return 1;
+
+	value = sampler_value(data, sub->rule_format, sub->rule_index);
+
+	// the threshold has the format of the value
+	threshold = sub->threshold;
+	if((sub->rule_format & FORMAT_SIGNED) && threshold > 0x7fff)
+		threshold -= 0x10000;
+
+	switch(sub->rule)
+	{
+	case RULE_ABOVE:
+		side = value > threshold;
+		fire = !sub->reported || side != sub->side;
+		sub->side = side;
+		break;
+
+	case RULE_BELOW:
+		side = value < threshold;
+		fire = !sub->reported || side != sub->side;
+		sub->side = side;
+		break;
+
+	case RULE_DELTA:
+		fire = !sub->reported || value - sub->last > sub->threshold || sub->last - value > sub->threshold;
+		break;
+
+	case RULE_CHANGE:
+		fire = !sub->reported || ((value ^ sub->last) & sub->threshold);
+		break;
+
+	default:
+		fire = 1;
+		break;
+	}
+
+	if(fire)
+	{
+		sub->last = value;
+		sub->reported = 1;
+	}
+
+	return fire;
+}
+
+int sampler_packet(unsigned char payload[], int size, unsigned char out[], unsigned int outsize)
+{
+	int len = 0;
+
+	if(size < 1)
+		return 0;
+
+	out[0] = payload[0];
+
+	switch (payload[0])
+	{
+	case STREAM_SUBSCRIBE:
+		len = sampler_subscribe(payload, size, out, outsize);
+		break;
+
+	case STREAM_TRIGGER:
+		len = sampler_subscribe_trigger(payload, size, out, outsize);
+		break;
+
+	case STREAM_AGGREGATE:
+		len = sampler_aggregate(payload, size, out, outsize);
+		break;
+
+	case STREAM_RULE:
+		len = sampler_set_rule(payload, size, out);
+		break;
+
+	case STREAM_UNSUBSCRIBE:
+		if(size >= 2 && payload[1] < SAMPLER_MAX_SUBSCRIPTIONS && subscriptions[payload[1]].active
+			&& subscriptions[payload[1]].channel == protocol_channel())
+		{
+			subscriptions[payload[1]].active = 0;
+			out[1] = payload[1];
+			len = 2;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	if(len == 0)
+	{
+		out[0] |= STREAM_ERROR;
+		len = 1;
+	}
+
+	return len;
+}
+
+void sampler_send(int id);
+void sampler_submit(subscription_t *sub, unsigned char* rxdata, I2C_callback_t callback);
+void sampler_read_done(I2C_transfer_t* transfer);
+void sampler_sample_done(I2C_transfer_t* transfer);
+
+// starts the read of a periodic sample, it is sent by the callback of its
+// transfer
+void sampler_read(int id, unsigned long now)
+{
+	subscription_t *sub = &subscriptions[id];
+	unsigned int maxlen;
+	unsigned char* out;
+
+	if(sub->state != SAMPLE_IDLE)
+	{
+		// the last sample or window has not been sent yet
+		sub->lost = 1;
+		return;
+	}
+
+	sub->time = now;
+
+	// an aggregated sample is read into the subscription and only the
+	// result of the window is sent
+	if(sub->mode != AGGREGATE_OFF)
+	{
+		sampler_submit(sub, sub->data, sampler_read_done);
+		return;
+	}
+
+	// the frame is in use or has shrunk, the next sample tells the host
+	out = protocol_tx_payload(sub->channel, &maxlen);
+	if(out == NULL || sub->len + STREAM_SAMPLE_HEADER_LEN > maxlen)
+	{
+		sub->lost = 1;
+		return;
+	}
+
+	// the data is read directly into the outgoing packet, which is held
+	// until the read has finished
+	protocol_tx_hold(sub->channel);
+	sampler_submit(sub, &out[STREAM_SAMPLE_HEADER_LEN], sampler_sample_done);
+}
+
+// sends a triggered sample once it has been read or the result of a window
+void sampler_send(int id)
+{
+	subscription_t *sub = &subscriptions[id];
+	unsigned char status = STREAM_SAMPLE;
+	unsigned int maxlen;
+	unsigned char* out;
+	int len;
+
+	if(!sub->active)
+	{
+		sub->state = SAMPLE_IDLE;
+		return;
+	}
+
+	// the frame is in use, sampler_poll() tries again
+	out = protocol_tx_payload(sub->channel, &maxlen);
+	if(out == NULL)
+		return;
+
+	if(sub->mode == AGGREGATE_STATS)
+	{
+		len = sampler_stats(id, out);
+		status = STREAM_STATS;
+		if(sub->failed)
+			status |= STREAM_ERROR;
+	}
+	else
+	{
+		memcpy(&out[STREAM_SAMPLE_HEADER_LEN], sub->data, sub->len);
+		len = STREAM_SAMPLE_HEADER_LEN + sub->len;
+		if(sub->error)
+			status |= STREAM_ERROR;
+	}
+
+	if(sub->lost)
+		status |= STREAM_LOST;
+
+	out[0] = status;
+	out[1] = id;
+	out[2] = sub->time >> 8;
+	out[3] = sub->time & 0xff;
+
+	sub->lost = 0;
+	sampler_window_reset(sub);
+	sub->state = SAMPLE_IDLE;
+
+	send_bt_request(sub->channel, STREAM_TYPE, len);
+}
+
+void sampler_read_done(I2C_transfer_t* transfer)
+{
+	int id;
+
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		subscription_t *sub = &subscriptions[id];
+
+		if(transfer == &sub->transfer)
+		{
+			sub->error = (transfer->status != I2C_OK);
+
+			// the window of an aggregated subscription is not complete yet
+			if(sub->mode != AGGREGATE_OFF && sub->active && !sampler_accumulate(sub, sub->error))
+			{
+				sub->state = SAMPLE_IDLE;
+				return;
+			}
+
+			// the rule did not fire
+			if(sub->active && !sampler_rule(sub, sub->data, sub->error))
+			{
+				sampler_window_reset(sub);
+				sub->state = SAMPLE_IDLE;
+				return;
+			}
+
+			sub->state = SAMPLE_READY;
+			sampler_send(id);
+			return;
+		}
+	}
+}
+
+// a periodic sample has been read into the outgoing packet
+void sampler_sample_done(I2C_transfer_t* transfer)
+{
+	int id;
+
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		subscription_t *sub = &subscriptions[id];
+		unsigned char status = STREAM_SAMPLE;
+		unsigned int maxlen;
+		unsigned char* out;
+
+		if(transfer != &sub->transfer)
+			continue;
+
+		sub->state = SAMPLE_IDLE;
+		protocol_tx_release(sub->channel);
+
+		// the connection is gone
+		out = protocol_tx_payload(sub->channel, &maxlen);
+		if(out == NULL || !sub->active)
+			return;
+
+		if(transfer->status != I2C_OK)
+			status |= STREAM_ERROR;
+
+		if(!sampler_rule(sub, &out[STREAM_SAMPLE_HEADER_LEN], status & STREAM_ERROR))
+			return;
+
+		if(sub->lost)
+			status |= STREAM_LOST;
+		sub->lost = 0;
+
+		out[0] = status;
+		out[1] = id;
+		out[2] = (sub->time >> 8) & 0xff;
+		out[3] = sub->time & 0xff;
+
+		send_bt_request(sub->channel, STREAM_TYPE, STREAM_SAMPLE_HEADER_LEN + sub->len);
+		return;
+	}
+}
+
+// submits the read of a sample, triggered samples and aggregated ones are
+// read into the subscription
+void sampler_submit(subscription_t *sub, unsigned char* rxdata, I2C_callback_t callback)
+{
+	sub->transfer.bus = sub->bus;
+	sub->transfer.addr = sub->addr;
+	sub->transfer.flags = I2C_FIRST | I2C_LAST;
+	sub->transfer.txdata = &sub->reg;
+	sub->transfer.txlen = 1;
+	sub->transfer.rxdata = rxdata;
+	sub->transfer.rxlen = sub->len;
+	sub->transfer.callback = callback;
+
+	sub->state = SAMPLE_READING;
+	I2C_submit(&sub->transfer);
+}
+
+// called from the port ISR with the pins which have changed and their new
+// values, starts the reads of the subscriptions triggered by them
+void sampler_trigger(unsigned char changed, unsigned char value, unsigned int time)
+{
+	int id;
+
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		subscription_t *sub = &subscriptions[id];
+
+		if(!sub->active || !(changed & sub->pin) || (value & sub->pin) != sub->edge)
+			continue;
+
+		if(sub->state != SAMPLE_IDLE)
+		{
+			sub->lost = 1;
+			continue;
+		}
+
+		sub->time = time;
+
+		// a block transfer may hold the bus, the read has to wait for it
+		if(protocol_bus_held())
+			sub->state = SAMPLE_TRIGGERED;
+		else
+			sampler_submit(sub, sub->data, sampler_read_done);
+	}
+}
+
+// called from the scheduler, runs all reads which are due
+void sampler_poll()
+{
+	int id;
+	unsigned long now;
+
+	// triggered samples which could not be sent or read yet
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		if(subscriptions[id].state == SAMPLE_READY)
+			sampler_send(id);
+	}
+
+	if(protocol_bus_held())
+		return;
+
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		subscription_t *sub = &subscriptions[id];
+
+		__disable_interrupt();
+		if(sub->state == SAMPLE_TRIGGERED)
+		{
+			if(sub->active)
+				sampler_submit(sub, sub->data, sampler_read_done);
+			else
+				sub->state = SAMPLE_IDLE;
+		}
+		__enable_interrupt();
+	}
+
+	now = BTPS_GetTickCount();
+
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		if(subscriptions[id].active && subscriptions[id].pin == 0 && (long)(now - subscriptions[id].due) >= 0)
+		{
+			// keep the period stable, but do not try to catch up on
+			// samples which have been missed
+			subscriptions[id].due += subscriptions[id].period;
+			if((long)(now - subscriptions[id].due) >= 0)
+				subscriptions[id].due = now + subscriptions[id].period;
+
+			sampler_read(id, now);
+		}
+	}
+}
+
+// true while the scheduler has to run for periodic reads or triggered
+// samples which are waiting, triggered subscriptions alone are woken up by
+// the port ISR
+int sampler_active()
+{
+	int id;
+
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		if((subscriptions[id].active && subscriptions[id].pin == 0) || subscriptions[id].state != SAMPLE_IDLE)
+			return 1;
+	}
+
+	return 0;
+}
+
+// drops the subscriptions of a host which has disconnected, a read which is
+// still running is dropped by its callback
+void sampler_reset(int channel)
+{
+	int id;
+
+	__disable_interrupt();
+
+	for(id = 0; id < SAMPLER_MAX_SUBSCRIPTIONS; id++)
+	{
+		subscription_t *sub = &subscriptions[id];
+
+		if(!sub->active || sub->channel != channel)
+			continue;
+
+		sub->active = 0;
+		if(sub->state != SAMPLE_READING)
+			sub->state = SAMPLE_IDLE;
+	}
+
+	__enable_interrupt();
+}
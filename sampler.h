@@ -0,0 +1,16 @@
+/*
+ * sampler.h
+ *
+ * Periodic i2c reads which are run by the device and streamed to the host.
+ */
+
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+int sampler_packet(unsigned char payload[], int size, unsigned char out[], unsigned int outsize);
+void sampler_poll();
+void sampler_trigger(unsigned char changed, unsigned char value, unsigned int time);
+int sampler_active();
+void sampler_reset(int channel);
+
+#endif /* SAMPLER_H_ */